@@ -0,0 +1,193 @@
+#include "storage.h"
+#include "commit_queue.h"
+#include "ring_log.h"
+
+#include "proto_bus.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#define ensure(condition) if (!(condition)) { throw std::logic_error("condition not met " #condition); }
+
+template<typename F>
+std::chrono::steady_clock::duration measure(F&& f) {
+    auto pt = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::steady_clock::now() - pt;
+}
+
+void print_rate(std::string header, std::chrono::steady_clock::duration time, size_t ops) {
+    std::cout << header << " " << std::chrono::duration_cast<std::chrono::nanoseconds>(time).count() / ops << "ns/op" << std::endl;
+}
+
+void print_latencies(std::vector<std::chrono::steady_clock::duration>& times, std::string header) {
+    std::sort(times.begin(), times.end());
+    auto ns = [&](double q) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(times[std::min<size_t>(times.size() * q, times.size() - 1)]).count();
+    };
+    std::cout << header << " q50 " << ns(0.5) << "ns q99 " << ns(0.99) << "ns max " << ns(1) << "ns" << std::endl;
+}
+
+std::string_view format_key(char* buf, size_t i) {
+    return std::string_view(buf, snprintf(buf, 32, "key%010zu", i));
+}
+
+void bench_storage(std::string engine, size_t keys) {
+    std::cout << "stats for " << engine << " keys=" << keys << std::endl;
+    auto storage = make_storage(engine);
+    std::mt19937_64 rng(keys);
+    char buf[32];
+    std::string value(32, 'a');
+
+    print_rate("insert", measure([&] {
+            for (size_t i = 0; i < keys; ++i) {
+                storage->set(format_key(buf, i), value);
+            }
+        }), keys);
+    ensure(storage->size() == keys);
+
+    size_t found = 0;
+    print_rate("random lookup", measure([&] {
+            for (size_t i = 0; i < keys; ++i) {
+                found += storage->find(format_key(buf, rng() % keys)).has_value();
+            }
+        }), keys);
+    ensure(found == keys);
+
+    value.assign(32, 'b');
+    print_rate("random overwrite", measure([&] {
+            for (size_t i = 0; i < keys; ++i) {
+                storage->set(format_key(buf, rng() % keys), value);
+            }
+        }), keys);
+
+    // the way snapshots are loaded: size is known in advance
+    storage->clear();
+    print_rate("snapshot load", measure([&] {
+            storage->reserve(keys);
+            for (size_t i = 0; i < keys; ++i) {
+                storage->set(format_key(buf, i), value);
+            }
+        }), keys);
+}
+
+// latency from commit (applied_ts moving past all of them) to each waiter's callback
+template<typename Push, typename Pick>
+void bench_commit_notifications(std::string header, size_t outstanding, Push&& push, Pick&& pick) {
+    std::vector<std::chrono::steady_clock::duration> latencies;
+    latencies.reserve(outstanding);
+    std::chrono::steady_clock::time_point committed;
+    for (size_t ts = 0; ts < outstanding; ++ts) {
+        bus::Promise<bool> promise;
+        promise.future().subscribe([&](bool&) { latencies.push_back(std::chrono::steady_clock::now() - committed); });
+        push(ts, std::move(promise));
+    }
+    committed = std::chrono::steady_clock::now();
+    std::vector<bus::Promise<bool>> subscribers;
+    print_rate(header + " pick", measure([&] { subscribers = pick(outstanding - 1); }), outstanding);
+    for (auto& promise : subscribers) {
+        promise.set_value(true);
+    }
+    ensure(latencies.size() == outstanding);
+    print_latencies(latencies, header + " notification");
+}
+
+void commit_queue_benchmark(const std::vector<size_t>& sizes) {
+    for (size_t outstanding : sizes) {
+        std::cout << "stats for " << outstanding << " outstanding writes" << std::endl;
+
+        CommitQueue<bus::Promise<bool>> queue;
+        bench_commit_notifications("ring", outstanding,
+            [&](int64_t ts, bus::Promise<bool> promise) { queue.push(ts, std::move(promise)); },
+            [&](int64_t applied_ts) {
+                std::vector<bus::Promise<bool>> subscribers;
+                queue.pop_until(applied_ts, [&](int64_t, bus::Promise<bool>& promise) { subscribers.push_back(std::move(promise)); });
+                return subscribers;
+            });
+
+        std::unordered_map<int64_t, bus::Promise<bool>> map;
+        int64_t base = 0;
+        bench_commit_notifications("unordered_map", outstanding,
+            [&](int64_t ts, bus::Promise<bool> promise) { map.insert({ ts, std::move(promise) }); },
+            [&](int64_t applied_ts) {
+                std::vector<bus::Promise<bool>> subscribers;
+                for (; base <= applied_ts; ++base) {
+                    if (auto it = map.find(base); it != map.end()) {
+                        subscribers.push_back(std::move(it->second));
+                        map.erase(it);
+                    }
+                }
+                return subscribers;
+            });
+    }
+}
+
+// steady state of the leader's in-memory log: every flush appends a batch and trims as much from the front,
+// the backlog kept for lagging followers stays the same
+template<typename Log, typename Trim>
+void bench_log_trim(std::string header, size_t backlog, Trim&& trim) {
+    constexpr size_t kBatch = 64;
+    constexpr size_t kRounds = 10000;
+    Log log;
+    auto entry = std::make_shared<const std::string>(100, 'a');
+    for (size_t i = 0; i < backlog; ++i) {
+        log.push_back(entry);
+    }
+    print_rate(header + " append and trim", measure([&] {
+            for (size_t round = 0; round < kRounds; ++round) {
+                for (size_t i = 0; i < kBatch; ++i) {
+                    log.push_back(entry);
+                }
+                trim(log, kBatch);
+            }
+        }), kRounds * kBatch);
+    ensure(log.size() == backlog);
+}
+
+void log_trim_benchmark(const std::vector<size_t>& sizes) {
+    using Entry = std::shared_ptr<const std::string>;
+    for (size_t backlog : sizes) {
+        std::cout << "stats for " << backlog << " records of backlog" << std::endl;
+        bench_log_trim<RingLog<Entry>>("ring", backlog, [](RingLog<Entry>& log, size_t count) { log.pop_front(count); });
+        bench_log_trim<std::vector<Entry>>("vector", backlog, [](std::vector<Entry>& log, size_t count) {
+                log.erase(log.begin(), log.begin() + count);
+            });
+    }
+}
+
+void storage_benchmark(const std::vector<size_t>& sizes) {
+    for (size_t keys : sizes) {
+        bench_storage("map", keys);
+        bench_storage("hash", keys);
+    }
+}
+
+int main(int argc, char** argv) {
+    ensure(argc >= 2);
+    std::vector<size_t> sizes;
+    for (int i = 2; i < argc; ++i) {
+        sizes.push_back(std::stoull(argv[i]));
+    }
+
+    std::map<std::string, void(*)(const std::vector<size_t>&)> benchmarks;
+    benchmarks["storage"] = [](const std::vector<size_t>& sizes) {
+        storage_benchmark(sizes.empty() ? std::vector<size_t>{1000000, 10000000} : sizes);
+    };
+    benchmarks["commit_queue"] = [](const std::vector<size_t>& sizes) {
+        commit_queue_benchmark(sizes.empty() ? std::vector<size_t>{100000} : sizes);
+    };
+
+    benchmarks["log_trim"] = [](const std::vector<size_t>& sizes) {
+        log_trim_benchmark(sizes.empty() ? std::vector<size_t>{1000, 100000} : sizes);
+    };
+
+    ensure(benchmarks.count(argv[1]));
+    benchmarks[argv[1]](sizes);
+}
@@ -7,7 +7,14 @@
 //#include <spdlog/spdlog.h>
 
 #include <json/reader.h>
+#include <json/writer.h>
+#include <cmath>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <random>
+#include <thread>
+#include <unordered_map>
 
 #define ensure(condition) if (!(condition)) { throw std::logic_error("condition not met " #condition); }
 #define verify(condition) if (!(condition)) { std::cerr << ("condition not met " #condition) << std::endl; std::terminate(); }
@@ -25,15 +32,31 @@ private:
         kClientReq = 3,
     };
 public:
-    Client(bus::ProtoBus::Options opts, bus::EndpointManager& manager, size_t members, duration timeout)
+    struct Options {
+        duration timeout;
+        bool follower_reads = false;
+        // concurrent lookups and writes are packed into requests of up to max_batch operations and max_batch_bytes,
+        // at most max_inflight requests are outstanding, the rest wait in the queue and form the next batches;
+        // zero bytes or in-flight requests mean no limit
+        size_t max_batch = 1;
+        size_t max_batch_bytes = 0;
+        size_t max_inflight = 0;
+    };
+
+    Client(bus::ProtoBus::Options opts, bus::EndpointManager& manager, size_t members, Options options)
         : ProtoBus(opts, manager)
-        , timeout_(timeout)
+        , options_(options)
+        , members_(members)
     {
         start();
     }
 
     bus::Future<ClientResponse> execute(ClientRequest req) {
-        return bound_execute(req, leader_.load())
+        return execute(std::move(req), leader_.load());
+    }
+
+    bus::Future<ClientResponse> execute(ClientRequest req, size_t member) {
+        return bound_execute(req, member)
             .chain([=] (ClientResponse& resp) {
                     if (resp.should_retry()) {
                         leader_.store(resp.retry_to());
@@ -44,26 +67,29 @@ public:
                 });
     }
 
+    bus::Future<bus::ErrorT<std::string>> async_lookup(std::string key) {
+        ClientRequest::Operation op;
+        op.set_type(ClientRequest::Operation::READ);
+        op.set_key(std::move(key));
+        return submit(std::move(op)).map([](ClientResponse& response) {
+                if (response.success() && response.entries_size() == 1) {
+                    return bus::ErrorT<std::string>::value(response.entries()[0].value());
+                } else {
+                    return bus::ErrorT<std::string>::error("fetch failed");
+                }
+            });
+    }
+
     bus::ErrorT<std::string> lookup(std::string key) {
-        ClientRequest req;
-        auto* op = req.add_operations();
-        op->set_type(ClientRequest::Operation::READ);
-        op->set_key(key);
-        ClientResponse response = execute(req).wait();
-        if (response.success() && response.entries_size() == 1) {
-            return bus::ErrorT<std::string>::value(response.entries()[0].value());
-        } else {
-            return bus::ErrorT<std::string>::error("fetch failed");
-        }
+        return async_lookup(std::move(key)).wait();
     }
 
     bus::Future<bool> async_write(std::string key, std::string value) {
-        ClientRequest req;
-        auto* op = req.add_operations();
-        op->set_type(ClientRequest::Operation::WRITE);
-        op->set_key(std::move(key));
-        op->set_value(std::move(value));
-        return execute(std::move(req)).map([](auto& err) { return err.success(); });
+        ClientRequest::Operation op;
+        op.set_type(ClientRequest::Operation::WRITE);
+        op.set_key(std::move(key));
+        op.set_value(std::move(value));
+        return submit(std::move(op)).map([](auto& err) { return err.success(); });
     }
 
     bool write(std::string key, std::string value) {
@@ -71,8 +97,74 @@ public:
     }
 
 private:
+    bus::Future<ClientResponse> submit(ClientRequest::Operation op) {
+        bus::Promise<ClientResponse> promise;
+        auto future = promise.future();
+        {
+            auto pipeline = pipeline_.get();
+            auto& queue = op.type() == ClientRequest::Operation::READ ? pipeline->reads : pipeline->writes;
+            queue.emplace_back(std::move(op), std::move(promise));
+        }
+        pump();
+        return future;
+    }
+
+    // sends queued operations while there are free in-flight slots, called on submit and on every response;
+    // reads and writes go in separate requests since the server rejects mixed ones
+    void pump() {
+        while (true) {
+            ClientRequest req;
+            std::vector<bus::Promise<ClientResponse>> callers;
+            bool reads;
+            {
+                auto pipeline = pipeline_.get();
+                if ((options_.max_inflight && pipeline->inflight >= options_.max_inflight) || (pipeline->reads.empty() && pipeline->writes.empty())) {
+                    return;
+                }
+                // alternate between the queues so that neither starves
+                reads = pipeline->writes.empty() || (!pipeline->reads.empty() && pipeline->reads_turn);
+                pipeline->reads_turn = !reads;
+                auto& queue = reads ? pipeline->reads : pipeline->writes;
+                size_t bytes = 0;
+                while (!queue.empty() && size_t(req.operations_size()) < std::max<size_t>(options_.max_batch, 1)) {
+                    bytes += queue.front().first.ByteSizeLong();
+                    if (req.operations_size() > 0 && options_.max_batch_bytes && bytes > options_.max_batch_bytes) {
+                        break;
+                    }
+                    *req.add_operations() = std::move(queue.front().first);
+                    callers.push_back(std::move(queue.front().second));
+                    queue.pop_front();
+                }
+                ++pipeline->inflight;
+            }
+            // with follower reads replicas answer after catching up with leader's commit
+            size_t member = reads && options_.follower_reads ? next_replica_.fetch_add(1) % members_ : leader_.load();
+            execute(req, member).subscribe([this, req, callers=std::move(callers)](ClientResponse& response) mutable {
+                    --pipeline_.get()->inflight;
+                    fan_out(req, response, callers);
+                    pump();
+                });
+        }
+    }
+
+    // callers of a read batch get the entry of their key, entries of multi-group requests are not in request order
+    static void fan_out(const ClientRequest& req, const ClientResponse& response, std::vector<bus::Promise<ClientResponse>>& callers) {
+        std::unordered_map<std::string_view, const ClientResponse::Entry*> entries;
+        for (auto& entry : response.entries()) {
+            entries.emplace(entry.key(), &entry);
+        }
+        for (size_t i = 0; i < callers.size(); ++i) {
+            ClientResponse part;
+            part.set_success(response.success());
+            if (auto it = entries.find(req.operations(i).key()); it != entries.end()) {
+                *part.add_entries() = *it->second;
+            }
+            callers[i].set_value(std::move(part));
+        }
+    }
+
     bus::Future<ClientResponse> bound_execute(ClientRequest req, size_t member) {
-        return send<ClientRequest, ClientResponse>(req, member, kClientReq, timeout_)
+        return send<ClientRequest, ClientResponse>(req, member, kClientReq, options_.timeout)
             .map([](bus::ErrorT<ClientResponse>& resp) {
                     if (resp) {
                         return resp.unwrap();
@@ -85,8 +177,18 @@ private:
     }
 
 private:
-    duration timeout_;
+    struct Pipeline {
+        std::deque<std::pair<ClientRequest::Operation, bus::Promise<ClientResponse>>> reads;
+        std::deque<std::pair<ClientRequest::Operation, bus::Promise<ClientResponse>>> writes;
+        bool reads_turn = false;
+        size_t inflight = 0;
+    };
+
+    Options options_;
+    size_t members_;
+    bus::internal::ExclusiveWrapper<Pipeline> pipeline_;
     std::atomic<size_t> leader_ = 0;
+    std::atomic<size_t> next_replica_ = 0;
 };
 
 template<typename F>
@@ -98,20 +200,97 @@ std::chrono::steady_clock::duration measure(F&& f, size_t repeats = 1) {
     return (std::chrono::steady_clock::now() - pt) / repeats;
 }
 
-void print_statistics(std::vector<std::chrono::steady_clock::duration>& times, std::string header) {
+// log-linear histogram in the spirit of HdrHistogram: values below 2^11 are exact, above that each power of two
+// is split into 1024 buckets, so a recorded value is off by less than 0.1%; record() is lock-free
+class HdrHistogram {
+private:
+    static constexpr int kSubBits = 11;
+    static constexpr uint64_t kSub = uint64_t(1) << kSubBits;
+    static constexpr uint64_t kHalf = kSub / 2;
+    static constexpr int kMagnitudes = 64 - kSubBits;
+
+public:
+    HdrHistogram()
+        : counts_(kSub + kMagnitudes * kHalf)
+    {
+    }
+
+    void record(std::chrono::steady_clock::duration time) {
+        uint64_t value = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(), 0);
+        counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        for (uint64_t min = min_.load(); value < min && !min_.compare_exchange_weak(min, value);) {
+        }
+        for (uint64_t max = max_.load(); value > max && !max_.compare_exchange_weak(max, value);) {
+        }
+    }
+
+    uint64_t count() const {
+        return count_.load();
+    }
+
+    // all in nanoseconds
+    uint64_t min() const {
+        return count() ? min_.load() : 0;
+    }
+
+    uint64_t max() const {
+        return max_.load();
+    }
+
+    uint64_t mean() const {
+        return count() ? sum_.load() / count() : 0;
+    }
+
+    uint64_t quantile(double q) const {
+        uint64_t rank = std::max<uint64_t>(std::ceil(q * count()), 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(highest_equivalent(i), max());
+            }
+        }
+        return max();
+    }
+
+private:
+    static size_t index(uint64_t value) {
+        if (value < kSub) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - (kSubBits - 1);
+        return kSub + (shift - 1) * kHalf + ((value >> shift) - kHalf);
+    }
+
+    static uint64_t highest_equivalent(size_t index) {
+        if (index < kSub) {
+            return index;
+        }
+        int shift = (index - kSub) / kHalf + 1;
+        uint64_t top = (index - kSub) % kHalf + kHalf;
+        return ((top + 1) << shift) - 1;
+    }
+
+private:
+    std::vector<std::atomic<uint64_t>> counts_;
+    std::atomic<uint64_t> count_ = 0;
+    std::atomic<uint64_t> sum_ = 0;
+    std::atomic<uint64_t> min_ = std::numeric_limits<uint64_t>::max();
+    std::atomic<uint64_t> max_ = 0;
+};
+
+void print_statistics(const HdrHistogram& times, std::string header) {
     std::cout << "stats for " << header << std::endl;
-    std::chrono::steady_clock::duration sum = std::chrono::steady_clock::duration::zero();
-    std::sort(times.begin(), times.end());
-    for (auto time : times) {
-        sum += time;
-    }
-    std::cout << "avg " << std::chrono::duration_cast<std::chrono::nanoseconds>(sum/times.size()).count() << "ns" << std::endl;
-    std::cout << "min " << std::chrono::duration_cast<std::chrono::nanoseconds>(times[0]).count() << "ns" << std::endl;
-    std::cout << "max " << std::chrono::duration_cast<std::chrono::nanoseconds>(times.back()).count() << "ns" << std::endl;
-    ssize_t q50 = std::min<ssize_t>(times.size() * 0.5, ssize_t(times.size()) - 1);
-    std::cout << "q50 " << std::chrono::duration_cast<std::chrono::nanoseconds>(times[q50]).count() << "ns" << std::endl;
-    ssize_t q90 = std::min<ssize_t>(times.size() * 0.9, ssize_t(times.size()) - 1);
-    std::cout << "q90 " << std::chrono::duration_cast<std::chrono::nanoseconds>(times[q90]).count() << "ns" << std::endl;
+    std::cout << "avg " << times.mean() << "ns" << std::endl;
+    std::cout << "min " << times.min() << "ns" << std::endl;
+    std::cout << "max " << times.max() << "ns" << std::endl;
+    std::cout << "q50 " << times.quantile(0.5) << "ns" << std::endl;
+    std::cout << "q90 " << times.quantile(0.9) << "ns" << std::endl;
+    std::cout << "q99 " << times.quantile(0.99) << "ns" << std::endl;
+    std::cout << "q99.9 " << times.quantile(0.999) << "ns" << std::endl;
+    std::cout << "q99.99 " << times.quantile(0.9999) << "ns" << std::endl;
 }
 
 void basic_workload(Client& client) {
@@ -124,7 +303,7 @@ void parallel_workload(Client& client) {
     constexpr size_t repeats = 5000;
     constexpr size_t mod = 10;
     bus::internal::Event event;
-    bus::internal::ExclusiveWrapper<std::vector<std::chrono::steady_clock::duration>> times;
+    HdrHistogram times;
     std::atomic_uint64_t inflight = 0;
     for (size_t i = 0; i < repeats; ++i) {
         event.reset();
@@ -145,7 +324,7 @@ void parallel_workload(Client& client) {
                 auto time = std::chrono::steady_clock::now() - pt;
                 verify(resp);
                 event.notify();
-                times.get()->push_back(time);
+                times.record(time);
             });
     }
     event.reset();
@@ -154,7 +333,7 @@ void parallel_workload(Client& client) {
         event.reset();
     }
 
-    print_statistics(*times.get(), "writes");
+    print_statistics(times, "writes");
 }
 
 void counter(Client& client) {
@@ -167,18 +346,19 @@ void counter(Client& client) {
 void one_thread_latency(Client& client) {
     constexpr size_t N = 100;
     constexpr size_t mod = 10;
-    std::vector<std::chrono::steady_clock::duration> writes, reads;
+    HdrHistogram writes, reads;
     for (size_t i = 0; i < N; ++i) {
         std::string key = std::to_string(i % mod);
         std::string value = std::to_string(2 * i);
-        writes.push_back(measure([&] { ensure(client.write(key, value));}));
-        std::cerr << std::chrono::duration_cast<std::chrono::microseconds>(writes.back()).count() << " taken client write" << std::endl;
+        auto time = measure([&] { ensure(client.write(key, value));});
+        writes.record(time);
+        std::cerr << std::chrono::duration_cast<std::chrono::microseconds>(time).count() << " taken client write" << std::endl;
     }
     std::cerr << "checking values" << std::endl;
     for (size_t i = N - mod; i < N; ++i) {
         std::string key = std::to_string(i % mod);
         std::string value = std::to_string(2 * i);
-        reads.push_back(measure([&] { ensure(client.lookup(key).unwrap() == value); }));
+        reads.record(measure([&] { ensure(client.lookup(key).unwrap() == value); }));
     }
     print_statistics(writes, "writes");
     print_statistics(reads, "reads");
@@ -187,18 +367,291 @@ void one_thread_latency(Client& client) {
 void many_writes(Client& client) {
     constexpr size_t N = 15000;
     constexpr size_t mod = 10;
-    std::vector<std::chrono::steady_clock::duration> writes, reads;
+    HdrHistogram writes, reads;
     for (size_t i = 0; i < N; ++i) {
         std::string key = std::to_string(i);
         std::string value;
         for (int j = 0; j < 1000; ++j) {
             value.push_back('a' + (i+j)%mod);
         }
-        writes.push_back(measure([&] { ensure(client.write(key, value));}));
+        writes.record(measure([&] { ensure(client.write(key, value));}));
     }
     print_statistics(writes, "writes");
 }
 
+// Gray et al. "Quickly generating billion-record synthetic databases", the generator YCSB uses
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint64_t items, double theta)
+        : items_(std::max<uint64_t>(items, 2))
+        , theta_(theta)
+        , alpha_(1 / (1 - theta))
+        , zetan_(zeta(items_, theta))
+        , eta_((1 - std::pow(2.0 / items_, 1 - theta)) / (1 - zeta(2, theta) / zetan_))
+    {
+    }
+
+    // 0 is the most popular item
+    template<typename Rng>
+    uint64_t operator()(Rng& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta_)) {
+            return 1;
+        }
+        return std::min<uint64_t>(items_ * std::pow(eta_ * u - eta_ + 1, alpha_), items_ - 1);
+    }
+
+private:
+    static double zeta(uint64_t items, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= items; ++i) {
+            sum += 1 / std::pow(i, theta);
+        }
+        return sum;
+    }
+
+private:
+    uint64_t items_;
+    double theta_;
+    double alpha_;
+    double zetan_;
+    double eta_;
+};
+
+// picks key indices out of [0, inserted): "uniform", "zipfian" (popular keys scattered over the key space)
+// or "latest" (the most recently inserted keys are the most popular)
+class KeyChooser {
+public:
+    KeyChooser(std::string distribution, uint64_t keys, double theta, const std::atomic<uint64_t>& inserted)
+        : distribution_(distribution)
+        , zipfian_(keys, theta)
+        , inserted_(inserted)
+    {
+        ensure(distribution_ == "uniform" || distribution_ == "zipfian" || distribution_ == "latest");
+    }
+
+    template<typename Rng>
+    uint64_t operator()(Rng& rng) const {
+        uint64_t count = std::max<uint64_t>(inserted_.load(), 1);
+        if (distribution_ == "uniform") {
+            return std::uniform_int_distribution<uint64_t>(0, count - 1)(rng);
+        }
+        uint64_t rank = zipfian_(rng);
+        if (distribution_ == "latest") {
+            return count - 1 - rank % count;
+        }
+        return fnv(rank) % count;
+    }
+
+private:
+    static uint64_t fnv(uint64_t val) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (int i = 0; i < 8; ++i, val >>= 8) {
+            hash = (hash ^ (val & 0xff)) * 0x100000001b3;
+        }
+        return hash;
+    }
+
+private:
+    std::string distribution_;
+    ZipfianGenerator zipfian_;
+    const std::atomic<uint64_t>& inserted_;
+};
+
+// "read", "update" or "insert" latencies of a run, nanoseconds
+Json::Value latency_json(const HdrHistogram& times, size_t failures) {
+    Json::Value op;
+    op["operations"] = Json::UInt64(times.count());
+    op["failures"] = Json::UInt64(failures);
+    op["avg_ns"] = Json::UInt64(times.mean());
+    op["min_ns"] = Json::UInt64(times.min());
+    op["p50_ns"] = Json::UInt64(times.quantile(0.5));
+    op["p90_ns"] = Json::UInt64(times.quantile(0.9));
+    op["p99_ns"] = Json::UInt64(times.quantile(0.99));
+    op["p999_ns"] = Json::UInt64(times.quantile(0.999));
+    op["p9999_ns"] = Json::UInt64(times.quantile(0.9999));
+    op["max_ns"] = Json::UInt64(times.max());
+    return op;
+}
+
+// closed loop: each of "threads" threads issues operations back to back; open loop (every entry of "rates"):
+// operations are issued at a fixed total rate whatever the latency, so queueing is not hidden, and every
+// latency is measured from the time the operation was due, not sent (coordinated omission correction);
+// a run lasts "warmup" + "duration" seconds and only operations due after warmup are counted;
+// the keys are loaded first unless "load" is false
+void ycsb_workload(Client& client, const Json::Value& conf) {
+    ensure(!conf.isNull());
+    const uint64_t keys = conf["keys"].asUInt64();
+    const double read_proportion = conf["read_proportion"].asDouble();
+    const double insert_proportion = conf["insert_proportion"].asDouble();
+    const size_t value_min = conf["value_size_min"].asUInt64();
+    const size_t value_max = std::max<size_t>(conf["value_size_max"].asUInt64(), value_min);
+    const size_t threads = std::max<size_t>(conf["threads"].asUInt64(), 1);
+    const auto warmup = parse_duration(conf["warmup"]);
+    const auto run = parse_duration(conf["duration"]);
+    ensure(keys > 0 && read_proportion + insert_proportion <= 1);
+
+    std::atomic<uint64_t> inserted = keys;
+    KeyChooser chooser(conf["distribution"].asString(), keys, conf.get("zipfian_constant", 0.99).asDouble(), inserted);
+    const std::string filler(value_max, 'v');
+    auto key_of = [](uint64_t index) { return "user" + std::to_string(index); };
+
+    if (conf.get("load", true).asBool()) {
+        std::atomic<uint64_t> next = 0;
+        std::vector<std::thread> loaders;
+        for (size_t t = 0; t < threads; ++t) {
+            loaders.emplace_back([&] {
+                    for (uint64_t i = next.fetch_add(1); i < keys; i = next.fetch_add(1)) {
+                        verify(client.write(key_of(i), filler.substr(0, value_max)));
+                    }
+                });
+        }
+        for (auto& loader : loaders) {
+            loader.join();
+        }
+    }
+
+    enum { kRead, kUpdate, kInsert, kOps };
+    const char* names[kOps] = { "read", "update", "insert" };
+    struct Stats {
+        HdrHistogram latencies[kOps];
+        std::atomic<size_t> failures[kOps] = {};
+        // successful operations that completed within the measured window, counted by completion time,
+        // so that throughput is what was served and not what was due
+        std::atomic<size_t> completed = 0;
+
+        void complete(bool ok, std::chrono::steady_clock::time_point measured, std::chrono::steady_clock::time_point deadline) {
+            auto now = std::chrono::steady_clock::now();
+            if (ok && now >= measured && now <= deadline) {
+                completed.fetch_add(1);
+            }
+        }
+    };
+
+    // issues an operation and calls done(type, ok) once it completes
+    auto issue = [&](std::mt19937_64& rng, auto done) {
+        double dice = std::uniform_real_distribution<double>(0, 1)(rng);
+        int type = dice < read_proportion ? kRead : dice < read_proportion + insert_proportion ? kInsert : kUpdate;
+        // an inserted key becomes visible to the chooser before its write completes, as in YCSB
+        uint64_t index = type == kInsert ? inserted.fetch_add(1) : chooser(rng);
+        if (type == kRead) {
+            client.async_lookup(key_of(index)).subscribe([done](auto& result) mutable { done(kRead, bool(result)); });
+        } else {
+            size_t size = std::uniform_int_distribution<size_t>(value_min, value_max)(rng);
+            client.async_write(key_of(index), filler.substr(0, size)).subscribe([done, type](bool& ok) mutable { done(type, ok); });
+        }
+    };
+
+    auto report = [&](Stats& stats) {
+        Json::Value result;
+        uint64_t total = 0;
+        uint64_t failures = 0;
+        for (int type = 0; type < kOps; ++type) {
+            if (stats.latencies[type].count() > 0) {
+                result["operations"][names[type]] = latency_json(stats.latencies[type], stats.failures[type].load());
+                total += stats.latencies[type].count();
+                failures += stats.failures[type].load();
+            }
+        }
+        result["operations_total"] = Json::UInt64(total);
+        result["failures_total"] = Json::UInt64(failures);
+        result["throughput_ops"] = stats.completed.load() / std::chrono::duration<double>(run).count();
+        return result;
+    };
+
+    auto closed_loop = [&] {
+        Stats stats;
+        auto measured = std::chrono::steady_clock::now() + warmup;
+        auto deadline = measured + run;
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                    std::mt19937_64 rng(t);
+                    for (auto now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now()) {
+                        bus::Promise<std::pair<int, bool>> completed;
+                        issue(rng, [completed](int type, bool ok) mutable { completed.set_value({ type, ok }); });
+                        auto [type, ok] = completed.future().wait();
+                        stats.complete(ok, measured, deadline);
+                        if (now >= measured) {
+                            stats.latencies[type].record(std::chrono::steady_clock::now() - now);
+                            stats.failures[type] += !ok;
+                        }
+                    }
+                });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        return report(stats);
+    };
+
+    auto open_loop = [&](double rate) {
+        ensure(rate > 0);
+        Stats stats;
+        std::atomic<size_t> outstanding = 0;
+        bus::internal::Event drained;
+        auto start = std::chrono::steady_clock::now();
+        auto measured = start + warmup;
+        auto deadline = measured + run;
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(threads / rate));
+        std::vector<std::thread> senders;
+        for (size_t t = 0; t < threads; ++t) {
+            senders.emplace_back([&, t] {
+                    std::mt19937_64 rng(t);
+                    // senders are staggered, together they are due every 1/rate seconds
+                    for (auto due = start + interval * t / threads; due < deadline; due += interval) {
+                        // a sender that fell behind catches up without sleeping, the lateness is in the latencies
+                        std::this_thread::sleep_until(due);
+                        outstanding.fetch_add(1);
+                        issue(rng, [&, due, measured, deadline](int type, bool ok) {
+                                stats.complete(ok, measured, deadline);
+                                if (due >= measured) {
+                                    stats.latencies[type].record(std::chrono::steady_clock::now() - due);
+                                    stats.failures[type] += !ok;
+                                }
+                                if (outstanding.fetch_sub(1) == 1) {
+                                    drained.notify();
+                                }
+                            });
+                    }
+                });
+        }
+        for (auto& sender : senders) {
+            sender.join();
+        }
+        drained.reset();
+        while (outstanding.load() > 0) {
+            drained.wait();
+            drained.reset();
+        }
+        auto result = report(stats);
+        result["target_rate"] = rate;
+        return result;
+    };
+
+    Json::Value result;
+    result["config"] = conf;
+    if (auto rates = conf["rates"]; !rates.isNull()) {
+        for (auto& rate : rates) {
+            result["runs"].append(open_loop(rate.asDouble()));
+        }
+    } else {
+        result["runs"].append(closed_loop());
+    }
+
+    Json::StreamWriterBuilder writer;
+    writer["indentation"] = "    ";
+    if (auto output = conf["output"]; !output.isNull()) {
+        std::ofstream(output.asString()) << Json::writeString(writer, result) << std::endl;
+    } else {
+        std::cout << Json::writeString(writer, result) << std::endl;
+    }
+}
+
 int main(int argc, char** argv) {
     ensure(argc == 2);
     Json::Value conf;
@@ -219,14 +672,25 @@ int main(int argc, char** argv) {
         manager.merge_to_endpoint(member["host"].asString(), member["port"].asInt(), i);
     }
 
-    Client client(opts, manager, members.size(), parse_duration(conf["timeout"]));
+    Client::Options options;
+    options.timeout = parse_duration(conf["timeout"]);
+    options.follower_reads = conf["follower_reads"].asBool();
+    options.max_batch = conf["client_batch"].asUInt64();
+    options.max_batch_bytes = conf["client_batch_bytes"].asUInt64();
+    options.max_inflight = conf["client_inflight"].asUInt64();
+    Client client(opts, manager, members.size(), options);
 
-    std::map<std::string, void(*)(Client&)> workloads;
-    workloads["basic"] = &basic_workload;
-    workloads["one_thread"] = &one_thread_latency;
-    workloads["parallel"] = &parallel_workload;
-    workloads["counter"] = &counter;
-    workloads["many_writes"] = &many_writes;
+    // workloads get the whole config and pick their own section of it
+    std::map<std::string, std::function<void(Client&, const Json::Value&)>> workloads;
+    auto unconfigured = [](void (*workload)(Client&)) {
+        return [workload](Client& client, const Json::Value&) { workload(client); };
+    };
+    workloads["basic"] = unconfigured(&basic_workload);
+    workloads["one_thread"] = unconfigured(&one_thread_latency);
+    workloads["parallel"] = unconfigured(&parallel_workload);
+    workloads["counter"] = unconfigured(&counter);
+    workloads["many_writes"] = unconfigured(&many_writes);
+    workloads["ycsb"] = [](Client& client, const Json::Value& conf) { ycsb_workload(client, conf["ycsb"]); };
 
-    workloads[conf["workload"].asString()](client);
+    workloads[conf["workload"].asString()](client, conf);
 }
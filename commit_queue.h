@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// items keyed by consecutive timestamps, stored in a ring at (ts - base) from head;
+// taking everything up to some ts is a sequential scan from head
+template<typename T>
+class CommitQueue {
+public:
+    CommitQueue() {
+        ring_.resize(kMinCapacity);
+    }
+
+    // ts below base are already committed and are rejected
+    bool push(int64_t ts, T item) {
+        if (ts < base_) {
+            return false;
+        }
+        size_t offset = ts - base_;
+        if (offset >= ring_.size()) {
+            grow(offset + 1);
+        }
+        ring_[(head_ + offset) & (ring_.size() - 1)] = std::move(item);
+        size_ = std::max(size_, offset + 1);
+        return true;
+    }
+
+    template<typename F>
+    void pop_until(int64_t ts, F&& f) {
+        while (size_ > 0 && base_ <= ts) {
+            auto& slot = ring_[head_];
+            if (slot) {
+                f(base_, *slot);
+                slot.reset();
+            }
+            head_ = (head_ + 1) & (ring_.size() - 1);
+            ++base_;
+            --size_;
+        }
+        if (size_ == 0 && base_ <= ts) {
+            base_ = ts + 1;
+        }
+    }
+
+    // drops all items, next expected ts is base
+    void reset(int64_t base) {
+        for (size_t i = 0; i < size_; ++i) {
+            ring_[(head_ + i) & (ring_.size() - 1)].reset();
+        }
+        head_ = size_ = 0;
+        base_ = base;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    static constexpr size_t kMinCapacity = 64;
+
+    void grow(size_t capacity) {
+        size_t new_size = ring_.size();
+        while (new_size < capacity) {
+            new_size *= 2;
+        }
+        std::vector<std::optional<T>> ring(new_size);
+        for (size_t i = 0; i < size_; ++i) {
+            ring[i] = std::move(ring_[(head_ + i) & (ring_.size() - 1)]);
+        }
+        ring_.swap(ring);
+        head_ = 0;
+    }
+
+private:
+    std::vector<std::optional<T>> ring_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+    int64_t base_ = 0;
+};
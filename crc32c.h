@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C (Castagnoli), the polynomial used by iSCSI, ext4 and SSE4.2 crc32 instruction
+inline const std::array<uint32_t, 256>& crc32c_table() {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> table;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            }
+            table[i] = crc;
+        }
+        return table;
+    }();
+    return table;
+}
+
+inline uint32_t crc32c_portable(std::string_view data, uint32_t crc = 0) {
+    auto& table = crc32c_table();
+    crc = ~crc;
+    for (unsigned char c : data) {
+        crc = table[(crc ^ c) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// 8 bytes per instruction, the rest byte by byte
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(std::string_view data, uint32_t crc = 0) {
+    uint64_t state = ~crc;
+    const char* ptr = data.data();
+    size_t size = data.size();
+    for (; size >= sizeof(uint64_t); ptr += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+    }
+    uint32_t result = state;
+    for (; size > 0; ++ptr, --size) {
+        result = _mm_crc32_u8(result, *ptr);
+    }
+    return ~result;
+}
+#endif
+
+inline uint32_t crc32c(std::string_view data, uint32_t crc = 0) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return crc32c_sse42(data, crc);
+    }
+#endif
+    return crc32c_portable(data, crc);
+}
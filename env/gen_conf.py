@@ -28,11 +28,32 @@ confs = {
         'heartbeat_interval': 0.3,
         'heartbeat_timeout': 0.01,
         'election_timeout': 4,
+        'lease_timeout': 3,
         'rotate_interval': 200,
+        'changelog_segment_size': 64 << 20,
         'applied_backlog': 0,
         'flush_interval': 0.005,
+        'flush_max_records': 64,
+        'flush_max_bytes': 1 << 20,
         'timeout': 2,
         'rpc_max_batch': 10,
+        'max_inflight_batches': 4,
+        'follower_reads': True,
+        'storage': 'hash',
+        'recovery_threads': 4,
+        'max_snapshot_deltas': 8,
+        'snapshot_chunk_size': 4096,
+        'snapshot_window': 16,
+        'recovery_bandwidth': 64 << 20,
+        'groups': 1,
+        'pin_cores': False,
+        'coalesce_window': 0.0002,
+        'coalesce_max_bytes': 512,
+        'client_batch': 32,
+        'client_batch_bytes': 2048,
+        'client_inflight': 8,
+        'log_memory_limit': 64 << 20,
+        'catchup_window': 16384,
         'log': 'storage/%d.dir' % (i,)
     }
     for i in nodes
@@ -47,6 +68,21 @@ client_conf = copy(next(iter(confs.values())))
 client_conf['port'] = port(quorum)
 del client_conf['id']
 del client_conf['log']
+client_conf['ycsb'] = {
+    'keys': 100000,
+    'read_proportion': 0.95,
+    'insert_proportion': 0.0,
+    'distribution': 'zipfian',
+    'zipfian_constant': 0.99,
+    'value_size_min': 100,
+    'value_size_max': 100,
+    'threads': 16,
+    'warmup': 5,
+    'duration': 30,
+    'load': True,
+    'rates': [1000, 2000, 5000, 10000, 20000],
+    'output': 'ycsb.json'
+}
 
 with open('client.json', 'w') as fout:
     json.dump(client_conf, fout, indent=4)
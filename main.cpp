@@ -4,18 +4,29 @@
 #include "delayed_executor.h"
 #include "error.h"
 #include "client.pb.h"
-
-#include <google/protobuf/arena.h>
+#include "storage.h"
+#include "commit_queue.h"
+#include "ring_log.h"
+#include "crc32c.h"
+#include "spsc_ring.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <thread>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <map>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <spdlog/spdlog.h>
 
@@ -30,6 +41,23 @@ bool exists(std::string_view fname) {
     return (stat(fname.data(), &buf) == 0);
 }
 
+// runs f(0), ..., f(tasks - 1) on at most `threads` threads
+template<typename F>
+void parallel_for(size_t tasks, size_t threads, F&& f) {
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::min(tasks, std::max<size_t>(threads, 1)); ++i) {
+        workers.emplace_back([&] {
+                for (size_t task; (task = next.fetch_add(1)) < tasks;) {
+                    f(task);
+                }
+            });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
 class DescriptorHolder {
 public:
     static constexpr int kInvalidFd = -1;
@@ -74,6 +102,9 @@ private:
     static constexpr size_t bufsz_ = 128 << 10;
 
 public:
+    // records are framed as uint32 size, uint32 crc32c of payload, payload
+    static constexpr size_t kRecordHeader = 2 * sizeof(uint32_t);
+
     BufferedFile() = default;
     BufferedFile(int fd) {
         set_fd(fd);
@@ -127,6 +158,28 @@ public:
         memcpy(&buffer_[ptr], &val, sizeof(val));
     }
 
+    // patches a header field once the body is written
+    void write_int64_at(size_t offset, int64_t val) {
+        flush();
+        FATAL(pwrite(*fd_, &val, sizeof(val), offset) != sizeof(val));
+    }
+
+    void write_uint32(uint32_t val) {
+        auto ptr = reserve(sizeof(val));
+        memcpy(&buffer_[ptr], &val, sizeof(val));
+    }
+
+    void write_bytes(std::string_view data) {
+        while (!data.empty()) {
+            if (data_ptr_ == bufsz_) {
+                flush();
+            }
+            size_t portion = std::min(data.size(), bufsz_ - data_ptr_);
+            memcpy(&buffer_[reserve(portion)], data.data(), portion);
+            data.remove_prefix(portion);
+        }
+    }
+
     std::optional<int64_t> read_int64() {
         int64_t val;
         if (auto ptr = fetch(sizeof(val))) {
@@ -137,12 +190,20 @@ public:
         }
     }
 
+    // nullopt on eof as well as on torn or corrupted record
     std::optional<LogRecord> read_log_record() {
-        auto header = read_int64();
-        if (!header) { return std::nullopt; }
-        if (auto ptr = fetch(*header)) {
+        uint32_t size, crc;
+        if (auto ptr = fetch(kRecordHeader)) {
+            memcpy(&size, &buffer_[*ptr], sizeof(size));
+            memcpy(&crc, &buffer_[*ptr + sizeof(size)], sizeof(crc));
+        } else {
+            return std::nullopt;
+        }
+        if (size > bufsz_ - kRecordHeader) { return std::nullopt; }
+        if (auto ptr = fetch(size)) {
+            std::string_view data(&buffer_[*ptr], size);
             LogRecord record;
-            if (!record.ParseFromArray(&buffer_[*ptr], *header)) { return std::nullopt; }
+            if (crc32c(data) != crc || !record.ParseFromArray(data.data(), data.size())) { return std::nullopt; }
             return record;
         } else {
             return std::nullopt;
@@ -150,10 +211,20 @@ public:
     }
 
     void write_log_record(const LogRecord& record) {
-        auto sz = record.ByteSizeLong();
-        write_int64(sz);
-        auto ptr = reserve(sz);
-        FATAL(!record.SerializeToArray(&buffer_[ptr], sz));
+        uint32_t size = record.ByteSizeLong();
+        auto ptr = reserve(kRecordHeader + size);
+        char* data = &buffer_[ptr + kRecordHeader];
+        FATAL(!record.SerializeToArray(data, size));
+        uint32_t crc = crc32c(std::string_view(data, size));
+        memcpy(&buffer_[ptr], &size, sizeof(size));
+        memcpy(&buffer_[ptr + sizeof(size)], &crc, sizeof(crc));
+    }
+
+    // same framing for already serialized records
+    void write_record(std::string_view data) {
+        write_uint32(data.size());
+        write_uint32(crc32c(data));
+        write_bytes(data);
     }
 
     void sync() {
@@ -161,6 +232,10 @@ public:
         FATAL(fdatasync(*fd_) != 0);
     }
 
+    int fd() {
+        return *fd_;
+    }
+
 private:
     DescriptorHolder fd_;
     char buffer_[bufsz_];
@@ -168,6 +243,337 @@ private:
     size_t consumed_ptr_ = 0;
 };
 
+// immutable once created, shared by buffered_log_, changelog writer and replication streams
+struct LogEntry {
+    LogEntry(LogRecord rec)
+        : record(std::move(rec))
+        , serialized(record.SerializeAsString())
+    {
+    }
+
+    LogEntry(LogRecord rec, std::string serialized)
+        : record(std::move(rec))
+        , serialized(std::move(serialized))
+    {
+    }
+
+    int64_t ts() const {
+        return record.ts();
+    }
+
+    const LogRecord record;
+    const std::string serialized;
+};
+
+using LogEntryPtr = std::shared_ptr<const LogEntry>;
+
+// raft groups of one process share a sync round: whoever finds none running starts one and fdatasyncs
+// the changelog of every group that asked before it started, so the others just wait for it
+class SharedSync {
+public:
+    void sync(int fd) {
+        std::unique_lock lock(mutex_);
+        uint64_t ticket = ++requested_;
+        pending_.insert(fd);
+        while (completed_ < ticket) {
+            if (running_) {
+                done_.wait(lock);
+                continue;
+            }
+            running_ = true;
+            uint64_t covered = requested_;
+            std::set<int> fds;
+            fds.swap(pending_);
+            lock.unlock();
+            for (int pending : fds) {
+                FATAL(fdatasync(pending) != 0);
+            }
+            lock.lock();
+            running_ = false;
+            completed_ = covered;
+            done_.notify_all();
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable done_;
+    // descriptors of requests not covered by a round yet
+    std::set<int> pending_;
+    uint64_t requested_ = 0;
+    uint64_t completed_ = 0;
+    bool running_ = false;
+};
+
+// changelog segment layout:
+//   int64 limit ts, segment holds records with greater timestamps
+//   records in BufferedFile framing
+//   footer of sealed segments: sparse index of (int64 ts, uint64 offset) pairs,
+//   uint64 index offset, uint64 index entries, uint64 magic
+class ChangelogWriter {
+public:
+    static constexpr uint64_t kMagic = 0x7865646e49676f4c;
+    static constexpr size_t kIndexStride = 128;
+    static constexpr size_t kRecordHeader = BufferedFile::kRecordHeader;
+
+    void open(int fd, int64_t limit_ts) {
+        seal();
+        file_.set_fd(fd);
+        file_.write_int64(limit_ts);
+        offset_ = sizeof(int64_t);
+        records_ = 0;
+        index_.clear();
+        opened_ = true;
+    }
+
+    void append(int64_t ts, std::string_view data) {
+        // followers rewrite conflicting suffixes, index has to stay sorted
+        while (!index_.empty() && index_.back().first >= ts) {
+            index_.pop_back();
+        }
+        if (index_.empty() || records_ % kIndexStride == 0) {
+            index_.push_back({ ts, offset_ });
+        }
+        ++records_;
+        file_.write_record(data);
+        offset_ += kRecordHeader + data.size();
+    }
+
+    void sync(SharedSync* shared = nullptr) {
+        if (shared) {
+            file_.flush();
+            shared->sync(file_.fd());
+        } else {
+            file_.sync();
+        }
+    }
+
+    // writes index footer, no appends after that
+    void seal() {
+        if (!opened_) {
+            return;
+        }
+        for (auto [ts, offset] : index_) {
+            file_.write_int64(ts);
+            file_.write_int64(offset);
+        }
+        file_.write_int64(offset_);
+        file_.write_int64(index_.size());
+        file_.write_int64(kMagic);
+        file_.sync();
+        file_.close();
+        opened_ = false;
+    }
+
+    size_t size() const {
+        return offset_;
+    }
+
+    // offset of an indexed record of the open segment at or before ts, readers of it start there
+    std::optional<uint64_t> offset_of(int64_t ts) const {
+        auto it = std::upper_bound(index_.begin(), index_.end(), std::make_pair(ts, std::numeric_limits<uint64_t>::max()));
+        if (!opened_ || it == index_.begin()) {
+            return std::nullopt;
+        }
+        return std::prev(it)->second;
+    }
+
+private:
+    BufferedFile file_;
+    bool opened_ = false;
+    size_t offset_ = 0;
+    size_t records_ = 0;
+    std::vector<std::pair<int64_t, uint64_t>> index_;
+};
+
+class MappedFile {
+public:
+    MappedFile(const std::string& fname) {
+        DescriptorHolder fd{open(fname.c_str(), O_RDONLY)};
+        struct stat st;
+        FATAL(fstat(*fd, &st) != 0);
+        size_ = st.st_size;
+        if (size_ > 0) {
+            data_ = static_cast<const char*>(mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, *fd, 0));
+            FATAL(data_ == MAP_FAILED);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    std::string_view data() const {
+        return std::string_view(data_, size_);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    template<typename T>
+    T load(size_t offset) const {
+        T val;
+        memcpy(&val, data_ + offset, sizeof(val));
+        return val;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// payload of a record in BufferedFile framing at offset, nullopt if it is torn or corrupted
+std::optional<std::string_view> unframe_record(const MappedFile& file, size_t offset, size_t end) {
+    if (offset + BufferedFile::kRecordHeader > end) {
+        return std::nullopt;
+    }
+    uint32_t size = file.load<uint32_t>(offset);
+    uint32_t crc = file.load<uint32_t>(offset + sizeof(uint32_t));
+    if (offset + BufferedFile::kRecordHeader + size > end) {
+        return std::nullopt;
+    }
+    auto data = file.data().substr(offset + BufferedFile::kRecordHeader, size);
+    if (crc32c(data) != crc) {
+        return std::nullopt;
+    }
+    return data;
+}
+
+// mmaps a whole segment, active segments have no footer and are scanned from the start
+class ChangelogReader {
+public:
+    ChangelogReader(const std::string& fname)
+        : file_(fname)
+        , size_(file_.size())
+    {
+        if (size_ < sizeof(int64_t)) {
+            return;
+        }
+        limit_ts_ = load<int64_t>(0);
+        position_ = sizeof(int64_t);
+        end_ = size_;
+
+        constexpr size_t trailer = 3 * sizeof(uint64_t);
+        if (size_ >= sizeof(int64_t) + trailer && load<uint64_t>(size_ - sizeof(uint64_t)) == ChangelogWriter::kMagic) {
+            uint64_t index_offset = load<uint64_t>(size_ - trailer);
+            uint64_t entries = load<uint64_t>(size_ - trailer + sizeof(uint64_t));
+            if (index_offset >= position_ && index_offset + entries * kIndexEntry + trailer == size_) {
+                end_ = index_offset;
+                index_offset_ = index_offset;
+                index_entries_ = entries;
+            }
+        }
+    }
+
+    std::optional<int64_t> limit_ts() const {
+        return limit_ts_;
+    }
+
+    // positions before the first record that could have ts
+    void seek(int64_t ts) {
+        size_t lo = 0, hi = index_entries_;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (load<int64_t>(index_offset_ + mid * kIndexEntry) <= ts) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo > 0) {
+            position_ = load<uint64_t>(index_offset_ + (lo - 1) * kIndexEntry + sizeof(int64_t));
+        }
+    }
+
+    // same for segments without a footer, offset is a record boundary taken from the writer's index
+    void seek_offset(size_t offset) {
+        if (offset >= position_ && offset <= end_) {
+            position_ = offset;
+        }
+    }
+
+    // stops (returns nullptr) at the end of segment or at a torn record
+    LogEntryPtr next() {
+        if (!limit_ts_ || position_ == end_) {
+            return nullptr;
+        }
+        corrupted_ = true;
+        auto data = unframe_record(file_, position_, end_);
+        LogRecord record;
+        if (!data || !record.ParseFromArray(data->data(), data->size())) {
+            return nullptr;
+        }
+        corrupted_ = false;
+        position_ += ChangelogWriter::kRecordHeader + data->size();
+        return std::make_shared<const LogEntry>(std::move(record), std::string(*data));
+    }
+
+    // record at an offset previously reported by position()
+    LogEntryPtr read_at(size_t offset) {
+        position_ = offset;
+        return next();
+    }
+
+    // next() stopped before the end of records
+    bool corrupted() const {
+        return corrupted_;
+    }
+
+    // offset of the first record not returned by next()
+    size_t position() const {
+        return position_;
+    }
+
+private:
+    static constexpr size_t kIndexEntry = sizeof(int64_t) + sizeof(uint64_t);
+
+    template<typename T>
+    T load(size_t offset) const {
+        return file_.load<T>(offset);
+    }
+
+private:
+    MappedFile file_;
+    size_t size_ = 0;
+    size_t end_ = 0;
+    size_t position_ = 0;
+    size_t index_offset_ = 0;
+    size_t index_entries_ = 0;
+    bool corrupted_ = false;
+    std::optional<int64_t> limit_ts_;
+};
+
+// resolved log kept as record locations in open segments, so it can be read back in parts
+// without decoding the segments again
+struct ChangelogIndex {
+    struct Location {
+        int64_t ts;
+        size_t segment;
+        size_t offset;
+    };
+
+    // records [begin, end) of the log
+    std::vector<LogEntryPtr> read(size_t begin, size_t end) {
+        std::vector<LogEntryPtr> records;
+        for (size_t i = begin; i < std::min(end, log.size()); ++i) {
+            auto entry = readers[log[i].segment]->read_at(log[i].offset);
+            if (!entry) {
+                break;
+            }
+            records.push_back(std::move(entry));
+        }
+        return records;
+    }
+
+    std::vector<std::unique_ptr<ChangelogReader>> readers;
+    std::vector<Location> log;
+};
+
 class VoteKeeper {
 public:
     VoteKeeper(std::string fname)
@@ -205,7 +611,187 @@ private:
     std::string fname_;
 };
 
-class RaftNode : bus::ProtoBus {
+// virtual clock token bucket shared by several senders, allows a burst of kBurst worth of rate
+class RateLimiter {
+private:
+    static constexpr auto kBurst = std::chrono::milliseconds(100);
+
+public:
+    RateLimiter(size_t bytes_per_second)
+        : rate_(bytes_per_second)
+    {
+    }
+
+    void acquire(size_t bytes) {
+        if (rate_ == 0) {
+            return;
+        }
+        std::chrono::steady_clock::time_point until;
+        {
+            std::lock_guard guard(mutex_);
+            next_ = std::max(next_, std::chrono::steady_clock::now() - kBurst);
+            next_ += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(double(bytes) / rate_));
+            until = next_;
+        }
+        std::this_thread::sleep_until(until);
+    }
+
+private:
+    const size_t rate_;
+    std::mutex mutex_;
+    std::chrono::steady_clock::time_point next_;
+};
+
+// key-value storage shared between the apply path and lock-free (w.r.t. RaftNode::State) readers
+class StateMachine {
+public:
+    StateMachine(std::unique_ptr<Storage> storage)
+        : data_(std::move(storage))
+    {
+    }
+
+    std::optional<std::string> lookup(const std::string& key) {
+        std::shared_lock lock(mutex_);
+        if (auto value = data_->find(key)) {
+            return std::string(*value);
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    void apply(const LogRecord& rec) {
+        std::unique_lock lock(mutex_);
+        for (auto& op : rec.operations()) {
+            unsafe_set(op.key(), op.value());
+        }
+    }
+
+    void set(const std::string& key, const std::string& value) {
+        std::unique_lock lock(mutex_);
+        unsafe_set(key, value);
+    }
+
+    // bulk load of persisted state (snapshots, deltas): keys are not tracked as dirty,
+    // the state loaded is on disk already and no view is open on it
+    void load(const LogRecord& rec) {
+        std::unique_lock lock(mutex_);
+        assert(view_keys_.empty());
+        for (auto& op : rec.operations()) {
+            data_->set(op.key(), op.value());
+        }
+    }
+
+    void reserve(size_t sz) {
+        std::unique_lock lock(mutex_);
+        data_->reserve(sz);
+    }
+
+    void clear() {
+        std::unique_lock lock(mutex_);
+        preserve_view();
+        data_->clear();
+        dirty_.clear();
+    }
+
+    // takes over other's contents, other gets the old ones
+    void swap(StateMachine& other) {
+        std::scoped_lock lock(mutex_, other.mutex_);
+        preserve_view();
+        data_.swap(other.data_);
+        dirty_.swap(other.dirty_);
+    }
+
+    // point-in-time view of the keys set since the previous view, that is what a delta snapshot holds.
+    // Opening is O(1); while the view is open the first overwrite of a key in it keeps the old value aside,
+    // so the view is read by another thread without stalling apply. Returns the number of keys.
+    size_t open_view() {
+        std::unique_lock lock(mutex_);
+        assert(view_keys_.empty() && view_preserved_.empty());
+        view_keys_.swap(dirty_);
+        return view_keys_.size();
+    }
+
+    // f(key, value) for every key of the open view, values are copied out in batches under the shared lock
+    template<typename F>
+    void for_each_in_view(F&& f) {
+        constexpr size_t kBatch = 1024;
+        std::vector<std::pair<std::string_view, std::string>> batch;
+        for (auto it = view_keys_.begin(); it != view_keys_.end();) {
+            batch.clear();
+            {
+                std::shared_lock lock(mutex_);
+                for (; it != view_keys_.end() && batch.size() < kBatch; ++it) {
+                    if (auto old = view_preserved_.find(*it); old != view_preserved_.end()) {
+                        batch.emplace_back(*it, old->second);
+                    } else {
+                        batch.emplace_back(*it, *data_->find(*it));
+                    }
+                }
+            }
+            for (auto& [key, value] : batch) {
+                f(key, value);
+            }
+        }
+    }
+
+    void close_view() {
+        std::unique_lock lock(mutex_);
+        view_keys_.clear();
+        view_preserved_.clear();
+    }
+
+    size_t size() {
+        std::shared_lock lock(mutex_);
+        return data_->size();
+    }
+
+    template<typename F>
+    void for_each(F&& f) {
+        std::shared_lock lock(mutex_);
+        data_->for_each(f);
+    }
+
+private:
+    // the open view keeps its values when the whole state goes away
+    void preserve_view() {
+        for (auto& key : view_keys_) {
+            if (!view_preserved_.count(key)) {
+                view_preserved_.emplace(key, *data_->find(key));
+            }
+        }
+    }
+
+    void unsafe_set(const std::string& key, const std::string& value) {
+        if (!view_keys_.empty() && view_keys_.count(key) && !view_preserved_.count(key)) {
+            view_preserved_.emplace(key, *data_->find(key));
+        }
+        data_->set(key, value);
+        dirty_.insert(key);
+    }
+
+private:
+    std::shared_mutex mutex_;
+    std::unique_ptr<Storage> data_;
+    // keys set since the last open_view()
+    std::unordered_set<std::string> dirty_;
+    // keys of the open view, not modified until close_view()
+    std::unordered_set<std::string> view_keys_;
+    // values the view had for keys overwritten since it was opened
+    std::unordered_map<std::string, std::string> view_preserved_;
+};
+
+// ProtoBus with its rpc interface opened up, so that several raft groups can share one
+class RaftTransport : public bus::ProtoBus {
+public:
+    using ProtoBus::ProtoBus;
+    using ProtoBus::register_handler;
+    using ProtoBus::send;
+    using ProtoBus::start;
+};
+
+class RaftNode {
+    friend class RaftGroups;
+
 private:
     enum NodeRole {
         kFollower = 0,
@@ -213,19 +799,19 @@ private:
         kCandidate = 2
     };
 
+public:
+    // offsets from Options::method_base
     enum {
         kVote = 1,
         kAppendRpcs = 2,
         kClientReq = 3,
-        kRecover = 4
+        kRecover = 4,
+        kReadIndex = 5,
+        kGroupMethods = 16
     };
 
 private:
     struct State {
-        BufferedFile recovery_snapshot_io_;
-        std::optional<std::pair<int64_t, int64_t>> recovery_snapshot_id_;
-        uint64_t recovery_snapshot_size_;
-
         uint64_t id_;
 
         size_t current_term_ = 0;
@@ -235,39 +821,140 @@ private:
         ssize_t applied_ts_ = -1;
         ssize_t next_ts_ = 0;
         ssize_t read_barrier_ts_ = -1;
+        // ts of the last snapshot or delta on disk, fsm dirty keys are relative to it
+        int64_t snapshot_ts_ = -1;
 
         std::set<int> voted_for_me_;
 
         std::vector<int64_t> next_timestamps_;
         std::vector<int64_t> durable_timestamps_;
 
-        std::unordered_map<int64_t, bus::Promise<bool>> commit_subscribers_;
+        // replication pipeline: ts after the latest sent batch and number of unacknowledged batches;
+        // responses from before a rollback carry an outdated epoch
+        std::vector<int64_t> sent_timestamps_;
+        std::vector<size_t> inflight_batches_;
+        std::vector<uint64_t> pipeline_epochs_;
+
+        void rollback_pipeline(size_t id, int64_t ts) {
+            next_timestamps_[id] = sent_timestamps_[id] = ts;
+            inflight_batches_[id] = 0;
+            ++pipeline_epochs_[id];
+        }
+
+        CommitQueue<bus::Promise<bool>> commit_subscribers_;
+        // follower reads waiting for applied_ts_
+        std::multimap<int64_t, bus::Promise<bool>> read_subscribers_;
 
         size_t flushed_index_ = 0;
-        std::vector<LogRecord> buffered_log_;
+        RingLog<LogEntryPtr> buffered_log_;
+        // serialized size of buffered_log_ records
+        size_t buffered_bytes_ = 0;
         bus::Promise<bool> flush_event_;
+        // written to buffered_log_ since last flush
+        size_t pending_records_ = 0;
+        size_t pending_bytes_ = 0;
+
+        void append(LogEntryPtr entry) {
+            ++pending_records_;
+            pending_bytes_ += entry->serialized.size();
+            buffered_bytes_ += entry->serialized.size();
+            buffered_log_.push_back(std::move(entry));
+        }
+
+        // drops applied and written records from the front: those applied_backlog behind applied_ts_, and more
+        // while the log is over memory_limit (0 is unlimited); followers behind the front catch up from changelogs
+        void trim_log(ssize_t applied_backlog, size_t memory_limit) {
+            size_t i = 0;
+            size_t bytes = buffered_bytes_;
+            for (; i < flushed_index_; ++i) {
+                int64_t ts = buffered_log_[i]->ts();
+                bool over_limit = memory_limit && bytes > memory_limit && ts <= applied_ts_;
+                if (ts + applied_backlog > applied_ts_ && !over_limit) {
+                    break;
+                }
+                bytes -= buffered_log_[i]->serialized.size();
+            }
+            if (i > 0) {
+                spdlog::debug("erased up to ts={0:d} record", buffered_log_[i - 1]->ts());
+            }
+            buffered_log_.pop_front(i);
+            flushed_index_ -= i;
+            buffered_bytes_ = bytes;
+        }
+
+        // keeps the first size records
+        void truncate_log(size_t size) {
+            for (size_t i = size; i < buffered_log_.size(); ++i) {
+                buffered_bytes_ -= buffered_log_[i]->serialized.size();
+            }
+            buffered_log_.truncate(size);
+            flushed_index_ = std::min(flushed_index_, buffered_log_.size());
+        }
 
-        std::map<std::string, std::string> fsm_;
+        StateMachine* fsm_ = nullptr;
 
         size_t current_changelog_ = 0;
 
+        // term of the buffered record at ts
+        std::optional<int64_t> term_at(int64_t ts) {
+            if (buffered_log_.empty() || ts < buffered_log_[0]->ts() || ts > buffered_log_.back()->ts()) {
+                return std::nullopt;
+            }
+            return buffered_log_[ts - buffered_log_[0]->ts()]->record.term();
+        }
+
+        // the same ts and term mean the same record, records no longer buffered are applied and can't conflict
         bool match_message(const LogRecord& rec) {
-            if (buffered_log_.empty() || rec.ts() < buffered_log_[0].ts() || rec.ts() > buffered_log_.back().ts()) {
-                return true;
+            auto term = term_at(rec.ts());
+            return !term || *term == rec.term();
+        }
+
+        // first unapplied record of the term that the record at ts has
+        int64_t first_of_term(int64_t ts) {
+            auto term = term_at(ts);
+            for (; ts - 1 > applied_ts_ && term_at(ts - 1) == term; --ts) {
+            }
+            return ts;
+        }
+
+        // a conflict answer has the follower's records from hint on in conflict_term, those the leader has
+        // in the same term match, so it resends from after its last one of them (up to limit)
+        int64_t resend_from(int64_t hint, int64_t conflict_term, int64_t limit) {
+            int64_t ts = hint;
+            for (; ts < limit && term_at(ts) == conflict_term; ++ts) {
             }
-            return buffered_log_[rec.ts() - buffered_log_[0].ts()].SerializeAsString() != rec.SerializeAsString();
+            return ts;
         }
 
+        // send times of the latest acknowledged heartbeats
         std::vector<std::chrono::system_clock::time_point> follower_heartbeats_;
         std::chrono::system_clock::time_point latest_heartbeat_;
         std::optional<uint64_t> leader_id_;
 
         std::vector<bus::Promise<bool>> pick_subscribers() {
             std::vector<bus::Promise<bool>> subscribers;
-            while (!commit_subscribers_.empty() && commit_subscribers_.begin()->first <= applied_ts_) {
-                spdlog::debug("fire commit subscriber for ts={0:d}", commit_subscribers_.begin()->first);
-                subscribers.push_back(commit_subscribers_.begin()->second);
-                commit_subscribers_.erase(commit_subscribers_.begin());
+            commit_subscribers_.pop_until(applied_ts_, [&](int64_t ts, bus::Promise<bool>& promise) {
+                spdlog::debug("fire commit subscriber for ts={0:d}", ts);
+                subscribers.push_back(std::move(promise));
+            });
+            return subscribers;
+        }
+
+        // waiters of an old term or leader are failed, the reads are retried
+        std::vector<bus::Promise<bool>> drop_read_subscribers() {
+            std::vector<bus::Promise<bool>> subscribers;
+            for (auto& [ts, promise] : read_subscribers_) {
+                subscribers.push_back(std::move(promise));
+            }
+            read_subscribers_.clear();
+            return subscribers;
+        }
+
+        std::vector<bus::Promise<bool>> pick_read_subscribers() {
+            std::vector<bus::Promise<bool>> subscribers;
+            while (!read_subscribers_.empty() && read_subscribers_.begin()->first <= applied_ts_) {
+                subscribers.push_back(read_subscribers_.begin()->second);
+                read_subscribers_.erase(read_subscribers_.begin());
             }
             return subscribers;
         }
@@ -282,19 +969,29 @@ private:
         }
 
         void apply(const LogRecord& rec) {
-            for (auto op : rec.operations()) {
-                fsm_[op.key()] = op.value();
+            fsm_->apply(rec);
+        }
+
+        // latest heartbeat acknowledged by a quorum (leader included)
+        std::chrono::system_clock::time_point quorum_heartbeat() {
+            std::vector<std::chrono::system_clock::time_point> times;
+            for (size_t id = 0; id < follower_heartbeats_.size(); ++id) {
+                if (id != id_) {
+                    times.push_back(follower_heartbeats_[id]);
+                }
             }
+            std::sort(times.begin(), times.end());
+            return times[follower_heartbeats_.size() / 2];
         }
 
         void advance_to(int64_t ts) {
             if (!buffered_log_.empty()) {
                 auto old_ts = applied_ts_;
-                ssize_t pos = applied_ts_ - ssize_t(buffered_log_[0].ts()) + 1;
+                ssize_t pos = applied_ts_ - ssize_t(buffered_log_[0]->ts()) + 1;
                 if (pos >= 0) {
-                    for (; pos < buffered_log_.size() && ts >= buffered_log_[pos].ts(); ++pos) {
-                        apply(buffered_log_[pos]);
-                        applied_ts_ = buffered_log_[pos].ts();
+                    for (; pos < buffered_log_.size() && ts >= buffered_log_[pos]->ts(); ++pos) {
+                        apply(buffered_log_[pos]->record);
+                        applied_ts_ = buffered_log_[pos]->ts();
                     }
                 }
                 if (old_ts < applied_ts_) {
@@ -323,118 +1020,261 @@ public:
         duration heartbeat_timeout;
         duration heartbeat_interval;
         duration election_timeout;
+        // should be less than election_timeout by the expected clock drift
+        duration lease_timeout;
         duration rotate_interval;
+        // changelog is continued in a new segment once it grows past this size
+        size_t changelog_segment_size;
+        // group commit: leader flushes after flush_interval or once enough records are pending
         duration flush_interval;
+        size_t flush_max_records;
+        size_t flush_max_bytes;
         std::filesystem::path dir;
 
         size_t rpc_max_batch;
+        // AppendRpcs batches in flight per follower
+        size_t max_inflight_batches;
         size_t members;
+        // state machine engine: "map" or "hash" (default)
+        std::string storage;
+        // workers decoding snapshots and changelogs
+        size_t recovery_threads;
+        // delta snapshots accumulated before they are merged into a new base
+        size_t max_snapshot_deltas;
+        // snapshot bytes per RecoverySnapshot message and messages in flight per follower
+        size_t snapshot_chunk_size;
+        size_t snapshot_window;
+        // bytes per second of snapshots and changelogs sent to lagging followers, all of them together; 0 is unlimited
+        size_t recovery_bandwidth;
+        // serve reads on followers after a ReadIndex round trip to the leader
+        bool follower_reads;
         ssize_t applied_backlog;
+        // raft groups hosted by the process, keys are spread across them (see RaftGroups)
+        size_t groups;
+        // rpc method ids of this node are method_base + k*
+        uint32_t method_base = 0;
+        // heartbeats are sent by the owner together with other groups' ones
+        bool batched_heartbeats = false;
+        // index among the process's raft groups, picks the core of the intake thread
+        size_t group = 0;
+        // pin each group's intake thread to a core of its own
+        bool pin_cores;
+        // leader packs client writes arriving within coalesce_window into shared records of up to coalesce_max_bytes
+        duration coalesce_window;
+        size_t coalesce_max_bytes;
+        // cap on serialized records kept in memory, 0 is unlimited; past it the leader fails writes (without a retry hint)
+        // until the quorum and the flusher catch up, followers lagging behind what is kept are served from changelogs catchup_window records at a time
+        size_t log_memory_limit;
+        size_t catchup_window;
     };
 
-    RaftNode(bus::EndpointManager& manager, Options options)
-        : bus::ProtoBus(options.bus_options, manager)
+    // handlers are registered here, the transport is to be started before start()
+    RaftNode(RaftTransport& bus, Options options, SharedSync* shared_sync = nullptr)
+        : bus_(bus)
+        , shared_sync_(shared_sync)
         , vote_keeper_(options.dir / "vote")
-        , buffer_pool_(options.bus_options.tcp_opts.max_message_size)
         , options_(options)
+        , fsm_(make_storage(options.storage))
         , elector_([this] { initiate_elections(); }, options.election_timeout)
         , rotator_([this] { rotate(); }, options.rotate_interval)
         , flusher_([this] { flush(); }, options.flush_interval)
         , sender_([this] { heartbeat_to_followers(); }, options.heartbeat_interval)
         , stale_nodes_agent_( [this] { recover_stale_nodes(); }, options.heartbeat_interval)
+        , recovery_limiter_(options.recovery_bandwidth)
     {
         {
             auto state = state_.get();
             assert(options.bus_options.greeter.has_value());
             state->id_ = id_ = *options.bus_options.greeter;
+            state->fsm_ = &fsm_;
             state->next_timestamps_.assign(options_.members, 0);
+            state->sent_timestamps_.assign(options_.members, 0);
+            state->inflight_batches_.assign(options_.members, 0);
+            state->pipeline_epochs_.assign(options_.members, 0);
             state->durable_timestamps_.assign(options_.members, -1);
             state->follower_heartbeats_.assign(options_.members, std::chrono::system_clock::time_point::min());
         }
         recover();
-        rotator_.delayed_start();
-        flusher_.start();
         using namespace std::placeholders;
-        register_handler<VoteRpc, Response>(kVote, [&] (int, VoteRpc rpc) { return bus::make_future(vote(rpc)); });
-        register_handler<AppendRpcs, Response>(kAppendRpcs, [=] (int node, AppendRpcs rpcs) { return handle_append_rpcs(node, std::move(rpcs)); });
-        register_handler<ClientRequest, ClientResponse>(kClientReq, [=](int node, ClientRequest req) { return handle_client_request(node, std::move(req)); } );
-        register_handler<RecoverySnapshot, Response>(kRecover, [&](int, RecoverySnapshot s) {
+        bus_.register_handler<VoteRpc, Response>(method(kVote), [&] (int, VoteRpc rpc) { return bus::make_future(vote(rpc)); });
+        bus_.register_handler<AppendRpcs, Response>(method(kAppendRpcs), [=] (int node, AppendRpcs rpcs) { return handle_append_rpcs(node, std::move(rpcs)); });
+        bus_.register_handler<ClientRequest, ClientResponse>(method(kClientReq), [=](int node, ClientRequest req) { return handle_client_request(node, std::move(req)); } );
+        bus_.register_handler<RecoverySnapshot, Response>(method(kRecover), [&](int, RecoverySnapshot s) {
             return bus::make_future(handle_recovery_snapshot(std::move(s)));
         });
-        ProtoBus::start();
+        bus_.register_handler<ReadIndexRpc, Response>(method(kReadIndex), [&](int, ReadIndexRpc rpc) {
+            return bus::make_future(handle_read_index(std::move(rpc)));
+        });
+        for (size_t id = 0; id < options_.members; ++id) {
+            replicators_.emplace_back(id == id_ ? nullptr
+                : std::make_unique<bus::internal::PeriodicExecutor>([this, id] { replicate_to(id); }, options.heartbeat_interval));
+        }
+    }
 
-        sender_.delayed_start();
+    void start() {
+        rotator_.delayed_start();
+        flusher_.start();
+        if (!options_.batched_heartbeats) {
+            sender_.delayed_start();
+        }
+        for (auto& replicator : replicators_) {
+            if (replicator) {
+                replicator->delayed_start();
+            }
+        }
         elector_.delayed_start();
         stale_nodes_agent_.start();
+        intake_thread_ = std::thread([this] { intake_loop(); });
+    }
+
+    ~RaftNode() {
+        stopping_ = true;
+        intake_.wake();
+        if (intake_thread_.joinable()) {
+            intake_thread_.join();
+        }
     }
 
     bus::internal::Event& shot_down() {
         return shot_down_;
     }
 
-private:
-    Response handle_recovery_snapshot(RecoverySnapshot s) {
+    uint32_t method(uint32_t k) const {
+        return options_.method_base + k;
+    }
+
+    // empty AppendRpcs to keep a follower from elections, nullopt unless leader;
+    // it carries the record before the follower's next_ts, so the follower applies only what matches
+    std::optional<AppendRpcs> heartbeat_rpc(size_t id) {
         auto state = state_.get();
-        if (state->role_ != kFollower) {
-            spdlog::info("not follower ignore snapshot");
-            return state->create_response(false);
+        if (state->role_ != kLeader) {
+            return std::nullopt;
         }
+        AppendRpcs rpcs;
+        rpcs.set_term(state->current_term_);
+        rpcs.set_applied_ts(state->applied_ts_);
+        rpcs.set_prev_ts(std::min<int64_t>(state->next_timestamps_[id], state->next_ts_) - 1);
+        rpcs.set_prev_term(state->term_at(rpcs.prev_ts()).value_or(0));
+        return rpcs;
+    }
 
-        if (s.applied_ts() <= state->applied_ts_ || s.term() != state->current_term_) {
-            spdlog::info("ignore snapshot with ts={0:d}, term={1:d} my ts={2:d} term={3:d}", s.applied_ts(), s.term(), state->applied_ts_, state->current_term_);
-            return state->create_response(false);
+    void handle_heartbeat_response(size_t id, uint64_t term, std::chrono::system_clock::time_point sent, bus::ErrorT<Response>& result) {
+        handle_append_response(id, term, 0, -1, sent, result);
+    }
+
+private:
+    // the leader's base snapshot file arrives in slices and is written in order under a temporary name;
+    // Response.offset tells the leader where to continue from, also after a broken transfer.
+    // File IO and loading happen under snapshot_receiver_, the state lock is taken only to check and to swap in.
+    Response handle_recovery_snapshot(RecoverySnapshot s) {
+        auto receiver = snapshot_receiver_.get();
+        // from the state already locked by the caller, the lock is not recursive
+        auto respond_locked = [&](State& state, bool success) {
+            auto response = state.create_response(success);
+            response.set_offset(receiver->received_);
+            return response;
+        };
+        auto respond = [&](bool success) {
+            return respond_locked(*state_.get(), success);
+        };
+        auto acceptable = [&](State& state) {
+            if (state.role_ != kFollower) {
+                spdlog::info("not follower ignore snapshot");
+                return false;
+            }
+            if (s.applied_ts() <= state.applied_ts_ || s.term() != state.current_term_) {
+                spdlog::info("ignore snapshot with ts={0:d}, term={1:d} my ts={2:d} term={3:d}", s.applied_ts(), s.term(), state.applied_ts_, state.current_term_);
+                return false;
+            }
+            return true;
+        };
+        if (!acceptable(*state_.get())) {
+            return respond(false);
         }
 
+        auto tmp_name = snapshot_name(s.applied_ts()) + ".tmp";
         std::pair<int64_t, int64_t> id = {s.term(), s.applied_ts()};
-        if (!state->recovery_snapshot_id_ || *state->recovery_snapshot_id_ != id) {
-            if (!s.start()) {
-                spdlog::info("ignore new snapshot without start attribute");
-                return state->create_response(false);
-            }
-            state->recovery_snapshot_io_.close();
-            state->recovery_snapshot_id_ = id;
-            // assert(!exists(snapshot_name(state->current_changelog_)));
-            // 2nd attempts could do it
-            state->recovery_snapshot_io_.set_fd(open(snapshot_name(s.applied_ts()).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR));
-            state->recovery_snapshot_size_ = s.size();
-            state->recovery_snapshot_io_.write_int64(state->recovery_snapshot_size_);
-            state->recovery_snapshot_io_.write_int64(s.applied_ts());
-            spdlog::info("start writing snapshot for ts={0:d}; size={1:d}", s.applied_ts(), s.size());
-        }
-
-        for (auto& op : s.operations()) {
-            state->fsm_[op.key()] = op.value();
-            LogRecord rec;
-            auto rec_op = rec.add_operations();
-            rec_op->set_key(op.key());
-            rec_op->set_value(op.value());
-            state->recovery_snapshot_io_.write_log_record(rec);
-            --state->recovery_snapshot_size_;
-        }
-
-        if (s.end()) {
-            if (state->recovery_snapshot_size_ == 0) {
-                state->recovery_snapshot_io_.sync();
-                state->applied_ts_ = s.applied_ts();
-                state->durable_ts_ = std::max(state->durable_ts_, state->applied_ts_);
-                state->next_ts_ = state->durable_ts_ + 1;
-                spdlog::info("sync recovery snapshot applied_ts={0:d}", s.applied_ts());
-            } else {
-                spdlog::info("failed recovery {0:d} parts remain", state->recovery_snapshot_size_);
-                state->recovery_snapshot_io_.close();
-                state->recovery_snapshot_id_ = std::nullopt;
-                return state->create_response(false);
+        if (receiver->id_ != id) {
+            receiver->id_ = id;
+            receiver->fd_.set(open(tmp_name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR));
+            receiver->size_ = s.size();
+            receiver->received_ = 0;
+            spdlog::info("start receiving snapshot for ts={0:d}; size={1:d}", s.applied_ts(), s.size());
+        }
+
+        uint64_t& received = receiver->received_;
+        if (s.offset() > received) {
+            return respond(false);
+        }
+        std::string_view data = s.data();
+        data.remove_prefix(std::min<size_t>(received - s.offset(), data.size()));
+        if (received + data.size() > receiver->size_) {
+            spdlog::warn("snapshot slice past the end of file");
+            return respond(false);
+        }
+        while (!data.empty()) {
+            auto written = pwrite(*receiver->fd_, data.data(), data.size(), received);
+            FATAL(written <= 0);
+            data.remove_prefix(written);
+            received += written;
+        }
+        if (received < receiver->size_) {
+            return respond(true);
+        }
+
+        FATAL(fdatasync(*receiver->fd_) != 0);
+        receiver->fd_.close();
+        receiver->id_ = std::nullopt;
+        FATAL(rename(tmp_name.c_str(), snapshot_name(s.applied_ts()).c_str()) != 0);
+        std::vector<bus::Promise<bool>> read_subscribers;
+        // built aside with the parallel loader, reads and heartbeats carry on meanwhile
+        StateMachine fsm{make_storage(options_.storage)};
+        int64_t ts;
+        if (!read_snapshot(snapshot_name(s.applied_ts()), kSnapshotHeader, ts, fsm)) {
+            spdlog::warn("received snapshot ts={0:d} is corrupted", s.applied_ts());
+            unlink(snapshot_name(s.applied_ts()).c_str());
+            received = 0;
+            return respond(false);
+        }
+        {
+            auto state = state_.get();
+            if (!acceptable(*state)) {
+                return respond_locked(*state, false);
+            }
+            fsm_.swap(fsm);
+            if (state->buffered_log_.empty() || state->buffered_log_.back()->ts() <= s.applied_ts()) {
+                // the snapshot covers everything buffered, the next record has to start the log over at its ts
+                state->truncate_log(0);
             }
+            state->applied_ts_ = s.applied_ts();
+            state->durable_ts_ = std::max(state->durable_ts_, state->applied_ts_);
+            state->next_ts_ = state->durable_ts_ + 1;
+            state->snapshot_ts_ = s.applied_ts();
+            read_subscribers = state->pick_read_subscribers();
         }
-        return state->create_response(true);
+        for (auto& sub : read_subscribers) {
+            sub.set_value(true);
+        }
+        spdlog::info("installed recovery snapshot applied_ts={0:d}", s.applied_ts());
+        return respond(true);
     }
 
     Response vote(VoteRpc rpc) {
+        std::vector<bus::Promise<bool>> dropped;
+        auto response = vote(&*state_.get(), std::move(rpc), dropped);
+        for (auto& sub : dropped) {
+            sub.set_value(false);
+        }
+        return response;
+    }
+
+    Response vote(State* state, VoteRpc rpc, std::vector<bus::Promise<bool>>& dropped) {
         spdlog::info("received vote request from {0:d} with ts={1:d} term={2:d}", rpc.vote_for(), rpc.ts(), rpc.term());
-        auto state = state_.get();
         if (state->current_term_ > rpc.term()) {
             return state->create_response(false);
         } else if (state->current_term_ < rpc.term()) {
+            reset_lease();
+            dropped = state->drop_read_subscribers();
             state->role_ = kCandidate;
             state->current_term_ = rpc.term();
             state->voted_for_me_.clear();
@@ -452,18 +1292,129 @@ private:
         }
     }
 
+    bool read_only(const ClientRequest& req) {
+        for (auto& op : req.operations()) {
+            if (op.type() != ClientRequest::Operation::READ) {
+                return false;
+            }
+        }
+        return req.operations_size() > 0;
+    }
+
+    bool write_only(const ClientRequest& req) {
+        for (auto& op : req.operations()) {
+            if (op.type() != ClientRequest::Operation::WRITE) {
+                return false;
+            }
+        }
+        return req.operations_size() > 0;
+    }
+
+    bool lease_valid() {
+        return std::chrono::system_clock::now().time_since_epoch().count() < lease_expiry_.load();
+    }
+
+    void reset_lease() {
+        lease_expiry_.store(std::numeric_limits<duration::rep>::min());
+    }
+
+    void update_lease(State& state) {
+        if (state.role_ != kLeader || state.applied_ts_ < state.read_barrier_ts_) {
+            return;
+        }
+        auto expiry = (state.quorum_heartbeat() + options_.lease_timeout).time_since_epoch().count();
+        if (expiry > lease_expiry_.load()) {
+            lease_expiry_.store(expiry);
+        }
+    }
+
+    ClientResponse read_fsm(const ClientRequest& req) {
+        ClientResponse response;
+        response.set_success(true);
+        for (auto& op : req.operations()) {
+            auto entry = response.add_entries();
+            entry->set_key(op.key());
+            entry->set_value(fsm_.lookup(op.key()).value_or(std::string()));
+        }
+        return response;
+    }
+
+    Response handle_read_index(ReadIndexRpc rpc) {
+        auto state = state_.get();
+        // lease_valid() implies that read barrier is applied
+        auto response = state->create_response(state->role_ == kLeader && rpc.term() == state->current_term_ && lease_valid());
+        response.set_commit_ts(state->applied_ts_);
+        return response;
+    }
+
+    bus::Future<bool> wait_applied(int64_t ts) {
+        auto state = state_.get();
+        if (state->applied_ts_ >= ts) {
+            return bus::make_future(true);
+        }
+        bus::Promise<bool> promise;
+        state->read_subscribers_.insert({ ts, promise });
+        return promise.future();
+    }
+
+    bus::Future<ClientResponse> follower_read(uint64_t leader, uint64_t term, ClientRequest req) {
+        ReadIndexRpc rpc;
+        rpc.set_term(term);
+        return bus_.send<ReadIndexRpc, Response>(std::move(rpc), leader, method(kReadIndex), options_.heartbeat_timeout)
+            .chain([this, leader, req=std::move(req)] (bus::ErrorT<Response>& r) {
+                    if (!r || !r.unwrap().success()) {
+                        ClientResponse response;
+                        response.set_success(false);
+                        response.set_retry_to(leader);
+                        response.set_should_retry(true);
+                        spdlog::debug("read index failed redirect to {0:d}", leader);
+                        return bus::make_future(std::move(response));
+                    }
+                    return wait_applied(r.unwrap().commit_ts()).map([this, leader, req] (bool applied) {
+                            if (applied) {
+                                return read_fsm(req);
+                            }
+                            ClientResponse response;
+                            response.set_success(false);
+                            response.set_retry_to(leader);
+                            response.set_should_retry(true);
+                            return response;
+                        });
+                });
+    }
+
     bus::Future<ClientResponse> handle_client_request(int id, ClientRequest req) {
-        bus::Future<bool> commit_future;
+        if (read_only(req) && lease_valid()) {
+            return bus::make_future(read_fsm(req));
+        }
+        if (write_only(req)) {
+            PendingWrite write;
+            for (auto& op : req.operations()) {
+                auto applied = write.record.add_operations();
+                applied->set_key(op.key());
+                applied->set_value(op.value());
+            }
+            auto future = write.promise.future();
+            intake_.push(std::move(write));
+            return future;
+        }
+        std::optional<uint64_t> read_index_leader;
+        uint64_t term;
         {
             auto state = state_.get();
             if (state->role_ == kFollower) {
-                ClientResponse response;
-                response.set_success(false);
                 assert(state->leader_id_);
-                response.set_retry_to(*state->leader_id_);
-                response.set_should_retry(true);
-                spdlog::debug("handling client request redirect to {0:d}", *state->leader_id_);
-                return bus::make_future(std::move(response));
+                if (options_.follower_reads && read_only(req)) {
+                    read_index_leader = *state->leader_id_;
+                    term = state->current_term_;
+                } else {
+                    ClientResponse response;
+                    response.set_success(false);
+                    response.set_retry_to(*state->leader_id_);
+                    response.set_should_retry(true);
+                    spdlog::debug("handling client request redirect to {0:d}", *state->leader_id_);
+                    return bus::make_future(std::move(response));
+                }
             }
             if (state->role_ == kCandidate) {
                 ClientResponse response;
@@ -484,7 +1435,7 @@ private:
                     if (op.type() == ClientRequest::Operation::READ) {
                         auto entry = response.add_entries();
                         entry->set_key(op.key());
-                        entry->set_value(state->fsm_[op.key()]);
+                        entry->set_value(fsm_.lookup(op.key()).value_or(std::string()));
                         has_reads = true;
                     }
                     if (op.type() == ClientRequest::Operation::WRITE) {
@@ -499,43 +1450,48 @@ private:
                     return bus::make_future(std::move(response));
                 }
                 rec.set_ts(state->next_ts_++);
+                rec.set_term(state->current_term_);
                 spdlog::debug("handling client request ts={0:d}", rec.ts());
                 auto promise = bus::Promise<bool>();
-                state->commit_subscribers_.insert({ rec.ts(), promise });
-                state->buffered_log_.push_back(std::move(rec));
-                sender_.trigger();
-                flusher_.trigger();
+                state->commit_subscribers_.push(rec.ts(), promise);
+                state->append(std::make_shared<const LogEntry>(std::move(rec)));
+                trigger_replication();
+                if (state->pending_records_ >= options_.flush_max_records || state->pending_bytes_ >= options_.flush_max_bytes) {
+                    flusher_.trigger();
+                }
                 return promise.future().map([response=std::move(response)](bool) { return response; });
             }
         }
+        if (read_index_leader) {
+            return follower_read(*read_index_leader, term, std::move(req));
+        }
         FATAL(true);
     }
 
     void initiate_elections() {
         size_t term;
+        std::vector<bus::Promise<bool>> dropped;
         {
             auto state = state_.get();
             auto now = std::chrono::system_clock::now();
             auto latest_heartbeat = state->latest_heartbeat_;
             if (state->role_ == kLeader) {
-                std::vector<std::chrono::system_clock::time_point> times;
-                for (size_t id = 0; id < options_.members; ++id) {
-                    if (id != id_) {
-                        times.push_back(state->follower_heartbeats_[id]);
-                    }
-                }
-                std::sort(times.begin(), times.end());
-                latest_heartbeat = times[options_.members / 2];
+                latest_heartbeat = state->quorum_heartbeat();
             }
             if (latest_heartbeat + options_.election_timeout > now) {
                 return;
             }
             spdlog::info("starting elections");
+            reset_lease();
             term = ++state->current_term_;
             state->voted_for_me_.clear();
             state->role_ = kCandidate;
             state->leader_id_ = std::nullopt;
             state->latest_heartbeat_ = now;
+            dropped = state->drop_read_subscribers();
+        }
+        for (auto& sub : dropped) {
+            sub.set_value(false);
         }
         std::this_thread::sleep_for((options_.election_timeout * (rand()%options_.members)) / (options_.members * 2));
         std::vector<bus::Future<bus::ErrorT<Response>>> responses;
@@ -560,7 +1516,7 @@ private:
                 rpc.set_vote_for(id_);
                 for (size_t id = 0; id < options_.members; ++id) {
                     if (id != id_) {
-                        responses.push_back(send<VoteRpc, Response>(rpc, id, kVote, options_.heartbeat_timeout));
+                        responses.push_back(bus_.send<VoteRpc, Response>(rpc, id, method(kVote), options_.heartbeat_timeout));
                         ids.push_back(id);
                     }
                 }
@@ -568,13 +1524,13 @@ private:
         }
         for (size_t i = 0; i < responses.size(); ++i) {
             responses[i]
-                .subscribe([&, id=ids[i], term] (bus::ErrorT<Response>& r) {
+                .subscribe([&, id=ids[i], term, sent=std::chrono::system_clock::now()] (bus::ErrorT<Response>& r) {
                         if (r && r.unwrap().success()) {
                             auto& response = r.unwrap();
                             auto state = state_.get();
                             state->next_timestamps_[id] = response.next_ts();
                             state->durable_timestamps_[id] = response.durable_ts();
-                            state->follower_heartbeats_[id] = std::chrono::system_clock::now();
+                            state->follower_heartbeats_[id] = sent;
                             if (state->current_term_ == term) {
                                 spdlog::info("granted vote from {0:d} with durable_ts={1:d}", id, response.durable_ts());
                                 state->voted_for_me_.insert(id);
@@ -583,11 +1539,14 @@ private:
                                     state->advance_applied_timestamp();
                                     state->read_barrier_ts_ = state->durable_ts_;
                                     spdlog::info("becoming leader applied up to {0:d} barrier ts {1:d}", state->applied_ts_, state->read_barrier_ts_);
-                                    state->commit_subscribers_.clear();
+                                    state->commit_subscribers_.reset(state->next_ts_);
                                     for (auto & ts : state->durable_timestamps_) {
                                         ts = std::min(ts, state->applied_ts_);
                                     }
                                     state->next_timestamps_.assign(options_.members, state->applied_ts_ + 1);
+                                    for (size_t id = 0; id < options_.members; ++id) {
+                                        state->rollback_pipeline(id, state->applied_ts_ + 1);
+                                    }
                                 }
                             }
                         }
@@ -597,14 +1556,21 @@ private:
 
     bus::Future<Response> handle_append_rpcs(int id, AppendRpcs msg) {
         bus::Future<bool> flush_event;
+        std::vector<bus::Promise<bool>> read_subscribers;
+        std::vector<bus::Promise<bool>> dropped;
+        std::optional<Response> conflict;
         bool has_new_records = false;
         {
             auto state = state_.get();
             if (msg.term() < state->current_term_) {
                 return bus::make_future(state->create_response(false));
             }
+            if (msg.term() > state->current_term_ || state->leader_id_ != std::optional<uint64_t>(id)) {
+                dropped = state->drop_read_subscribers();
+            }
             if (msg.term() > state->current_term_) {
                 spdlog::info("stale term becoming follower");
+                reset_lease();
                 state->current_term_ = msg.term();
             }
             assert(state->role_ != kLeader);
@@ -612,36 +1578,64 @@ private:
             state->latest_heartbeat_ = std::chrono::system_clock::now();
             state->leader_id_ = id;
 
-            for (auto& rpc : msg.records()) {
-                if (rpc.ts() <= state->applied_ts_) {
-                    continue;
+            // applied_ts only moves through the prefix checked against the leader by this message
+            int64_t verified_ts = msg.prev_ts();
+            if (msg.prev_term()) {
+                if (auto term = state->term_at(msg.prev_ts()); term && *term != msg.prev_term()) {
+                    // the whole term is suspect, the leader backs up past it in one round trip
+                    int64_t hint = state->first_of_term(msg.prev_ts());
+                    spdlog::debug("conflict at ts={0:d} term={1:d}, asking from ts={2:d}", msg.prev_ts(), *term, hint);
+                    state->durable_ts_ = std::min<ssize_t>(state->durable_ts_, hint - 1);
+                    conflict = state->create_response(true);
+                    conflict->set_next_ts(hint);
+                    conflict->set_conflict_term(*term);
                 }
-                if (state->next_ts_ > rpc.ts()) {
-                    if (state->match_message(rpc)) {
-                        continue;
+            }
+            // on a conflict nothing is verified, records before the hint may be of an older diverged term too
+            if (!conflict) {
+                for (auto& rpc : msg.records()) {
+                    if (rpc.ts() > state->applied_ts_) {
+                        if (state->next_ts_ > rpc.ts() && !state->match_message(rpc)) {
+                            if (state->buffered_log_.size() > 0) {
+                                state->truncate_log(std::max<ssize_t>(0, rpc.ts() - state->buffered_log_[0]->ts()));
+                            }
+                            state->next_ts_ = rpc.ts();
+                            state->durable_ts_ = std::min<ssize_t>(state->durable_ts_, rpc.ts() - 1);
+                        }
+                        if (rpc.ts() == state->next_ts_) {
+                            state->append(std::make_shared<const LogEntry>(rpc));
+                            ++state->next_ts_;
+                            has_new_records = true;
+                        }
                     }
-                    if (state->buffered_log_.size() > 0) {
-                        state->buffered_log_.resize(std::max<ssize_t>(0, rpc.ts() - state->buffered_log_[0].ts() + 1));
-                        state->flushed_index_ = std::min(state->flushed_index_, state->buffered_log_.size());
+                    if (rpc.ts() == verified_ts + 1 && rpc.ts() < state->next_ts_) {
+                        verified_ts = rpc.ts();
                     }
-                    state->next_ts_ = rpc.ts();
-                    state->durable_ts_ = std::min<ssize_t>(state->durable_ts_, rpc.ts() - 1);
                 }
-                if (rpc.ts() == state->next_ts_) {
-                    state->buffered_log_.push_back(rpc);
-                    ++state->next_ts_;
-                    has_new_records = true;
+                if (msg.records_size()) {
+                    spdlog::debug("handling heartbeat next_ts={0:d}", state->next_ts_);
                 }
+                state->advance_to(std::min({ msg.applied_ts(), static_cast<int64_t>(state->durable_ts_), verified_ts }));
+                read_subscribers = state->pick_read_subscribers();
+                flush_event = state->flush_event_.future();
             }
-            if (msg.records_size()) {
-                spdlog::debug("handling heartbeat next_ts={0:d}", state->next_ts_);
-            }
-            state->advance_to(std::min(msg.applied_ts(), state->durable_ts_));
-            flush_event = state->flush_event_.future();
+        }
+        for (auto& sub : dropped) {
+            sub.set_value(false);
+        }
+        if (conflict) {
+            return bus::make_future(std::move(*conflict));
+        }
+        for (auto& sub : read_subscribers) {
+            sub.set_value(true);
         }
         if (has_new_records) {
             flusher_.trigger();
         }
+        if (!msg.records_size()) {
+            // heartbeats don't wait for fsync
+            return bus::make_future(state_.get()->create_response(true));
+        }
         return flush_event.map([this](bool) { return state_.get()->create_response(true); });
     }
 
@@ -652,7 +1646,7 @@ private:
         if (auto state = state_.get(); state->role_ == kLeader) {
             term = state->current_term_;
             for (size_t id = 0; id < options_.members; ++id) {
-                int64_t ts = !state->buffered_log_.empty() ? state->buffered_log_[0].ts() : state->applied_ts_;
+                int64_t ts = !state->buffered_log_.empty() ? state->buffered_log_[0]->ts() : state->applied_ts_;
                 if (id_ != id) {
                     if (state->next_timestamps_[id] < ts) {
                         nodes.push_back(id);
@@ -664,174 +1658,384 @@ private:
             return;
         }
 
-        BufferedFile io;
-
-        auto recover_node = [&](size_t node, int64_t next) {
-            uint64_t snapshot_ts = 0;
-            spdlog::info("starting recovery for {0:d} ts={1:d}", node, next);
-            auto snapshots = discover_snapshots();
-            std::map<std::string, std::string> fsm;
-            while (!snapshots.empty()) {
-                int64_t ts;
-                if (read_snapshot(io, snapshots.back(), ts, fsm)) {
-                    auto check_response = [&, first_portion=true] (RecoverySnapshot rec, uint64_t node) mutable {
-                        rec.set_start(first_portion);
-                        first_portion = false;
-                        auto f = send<RecoverySnapshot, Response>(std::move(rec), node, kRecover, options_.heartbeat_timeout);
-                        auto& response = f.wait();
-                        if (!response || !response.unwrap().success()) {
-                            spdlog::debug("failing to send snapshot");
-                            return false;
-                        } else {
-                            return true;
+        if (nodes.empty()) {
+            return;
+        }
+
+        // one base snapshot and every changelog window read are shared by all lagging followers
+        auto snapshot = open_base_snapshot(*std::min_element(nexts.begin(), nexts.end()));
+        std::vector<int64_t> acked(nexts);
+        std::vector<char> alive(nodes.size(), true);
+        parallel_for(nodes.size(), nodes.size(), [&](size_t i) {
+                if (!snapshot || nexts[i] > snapshot->first) {
+                    return;
+                }
+                auto& [ts, file] = *snapshot;
+                spdlog::info("sending snapshot for ts={0:d} size={1:d} to {2:d}", ts, file->size(), nodes[i]);
+                if ((alive[i] = send_snapshot(nodes[i], term, ts, *file))) {
+                    nexts[i] = acked[i] = ts + 1;
+                }
+            });
+
+        // changelogs are decoded once into record locations and records are loaded catchup_window
+        // at a time, so catching up holds a bounded number of records however far behind followers are
+        int64_t log_start = std::numeric_limits<int64_t>::max();
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (alive[i]) {
+                log_start = std::min(log_start, nexts[i]);
+            }
+        }
+        auto changelog = log_start != std::numeric_limits<int64_t>::max() ? index_changelogs(log_start) : ChangelogIndex();
+        for (size_t begin = 0; begin < changelog.log.size(); begin += options_.catchup_window) {
+            if (std::none_of(alive.begin(), alive.end(), [](char a) { return a; })) {
+                break;
+            }
+            auto records = changelog.read(begin, begin + options_.catchup_window);
+            if (records.empty()) {
+                break;
+            }
+            int64_t from = records.front()->ts();
+            if (auto state = state_.get(); state->role_ != kLeader || state->current_term_ != term) {
+                return;
+            }
+            spdlog::debug("replaying changelogs from ts={0:d} to ts={1:d}", from, records.back()->ts());
+            parallel_for(nodes.size(), nodes.size(), [&](size_t i) {
+                    size_t node = nodes[i];
+                    for (size_t start = std::max<int64_t>(nexts[i] - from, 0); alive[i] && start < records.size(); start += options_.rpc_max_batch) {
+                        size_t end = std::min<size_t>(start + options_.rpc_max_batch, records.size());
+                        AppendRpcsRaw rpc;
+                        rpc.set_term(term);
+                        rpc.set_prev_ts(records[start]->ts() - 1);
+                        if (start > 0) {
+                            rpc.set_prev_term(records[start - 1]->record.term());
                         }
-                    };
-                    if (next <= ts) {
-                        spdlog::info("sending snapshot for ts={0:d} to {1:d}", ts, node);
-                        RecoverySnapshot rec;
-                        for (auto item : fsm) {
-                            auto op = rec.add_operations();
-                            op->set_key(item.first);
-                            op->set_value(item.second);
-                            if (rec.operations_size() >= options_.rpc_max_batch) {
-                                rec.set_applied_ts(ts);
-                                rec.set_size(fsm.size());
-                                if (!check_response(std::move(rec), node)) {
-                                    return;
-                                }
-                                rec.Clear();
-                            }
+                        spdlog::debug("sending changelogs from {0:d} to {1:d} to {2:d}", records[start]->ts(), records[end - 1]->ts(), node);
+                        size_t bytes = 0;
+                        for (size_t j = start; j < end; ++j) {
+                            rpc.add_records(records[j]->serialized);
+                            bytes += records[j]->serialized.size();
                         }
-                        rec.set_term(term);
-                        rec.set_applied_ts(ts);
-                        rec.set_size(fsm.size());
-                        rec.set_end(true);
-                        if (!check_response(std::move(rec), node)) {
-                            return;
+                        recovery_limiter_.acquire(bytes);
+                        auto response = bus_.send<AppendRpcsRaw, Response>(std::move(rpc), node, method(kAppendRpcs), options_.heartbeat_timeout).wait();
+                        if (!response || !response.unwrap().success()) {
+                            spdlog::debug("failing to send changelogs");
+                            alive[i] = false;
+                            break;
                         }
-                        next = ts + 1;
-                        break;
+                        acked[i] = response.unwrap().next_ts();
+                        nexts[i] = records[end - 1]->ts() + 1;
                     }
+                });
+        }
+
+        auto state = state_.get();
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            spdlog::info("recovery of {0:d} acknowledged timestamp {1:d}", nodes[i], acked[i]);
+            state->next_timestamps_[nodes[i]] = std::max(state->next_timestamps_[nodes[i]], acked[i]);
+        }
+    }
+
+    // base snapshot covering everything up to some ts >= next, deltas are merged into it first
+    std::optional<std::pair<int64_t, std::unique_ptr<MappedFile>>> open_base_snapshot(int64_t next) {
+        auto snapshots = discover_snapshots();
+        auto deltas = discover_deltas();
+        int64_t newest = std::max(snapshots.empty() ? -1 : int64_t(snapshots.back()), deltas.empty() ? -1 : int64_t(deltas.back()));
+        if (newest < next) {
+            return std::nullopt;
+        }
+        merge_snapshots(true);
+        std::shared_lock lock(snapshot_files_mutex_);
+        snapshots = discover_snapshots();
+        if (snapshots.empty() || int64_t(snapshots.back()) < next) {
+            return std::nullopt;
+        }
+        return std::make_pair(int64_t(snapshots.back()), std::make_unique<MappedFile>(snapshot_name(snapshots.back())));
+    }
+
+    // streams the file in snapshot_chunk_size slices with up to snapshot_window of them in flight;
+    // the follower reports how much it has, so a broken transfer continues where it stopped
+    bool send_snapshot(size_t node, int64_t term, int64_t ts, const MappedFile& file) {
+        constexpr size_t kMaxRetries = 3;
+        size_t chunk = std::max<size_t>(options_.snapshot_chunk_size, 1);
+        std::deque<std::pair<size_t, bus::Future<bus::ErrorT<Response>>>> inflight;
+        size_t sent = 0;
+        size_t acked = 0;
+        size_t retries = 0;
+        while (acked < file.size()) {
+            while (inflight.size() < std::max<size_t>(options_.snapshot_window, 1) && sent < file.size()) {
+                RecoverySnapshot rec;
+                rec.set_term(term);
+                rec.set_applied_ts(ts);
+                rec.set_size(file.size());
+                rec.set_offset(sent);
+                size_t size = std::min(chunk, file.size() - sent);
+                rec.set_data(file.data().data() + sent, size);
+                recovery_limiter_.acquire(size);
+                inflight.emplace_back(sent + size, bus_.send<RecoverySnapshot, Response>(std::move(rec), node, method(kRecover), options_.heartbeat_timeout));
+                sent += size;
+            }
+            if (inflight.empty()) {
+                sent = acked;
+                continue;
+            }
+            auto future = std::move(inflight.front().second);
+            inflight.pop_front();
+            auto& response = future.wait();
+            if (!response || response.unwrap().term() > term) {
+                spdlog::debug("failing to send snapshot");
+                return false;
+            }
+            acked = std::max<size_t>(acked, response.unwrap().offset());
+            if (!response.unwrap().success()) {
+                if (++retries > kMaxRetries) {
+                    spdlog::debug("snapshot rejected at offset={0:d}", acked);
+                    return false;
                 }
-                snapshots.pop_back();
-            }
-            spdlog::info("replaying logs for {0:d} from ts={1:d}", node, next);
-            auto changelogs = discover_changelogs();
-            std::vector<LogRecord> records;
-            std::reverse(changelogs.begin(), changelogs.end());
-            for (size_t changelog : changelogs) {
-                io.set_fd(open(changelog_name(changelog).c_str(), O_RDONLY));
-                if (auto ts = io.read_int64()) {
-                    spdlog::debug("open changelog {0:d}, limit ts={1:d}", changelog, *ts);
-                    iterate_changelog(io, [&](LogRecord rec) {
-                            if (rec.ts() >= next) {
-                                records.resize(std::max<size_t>(records.size(), rec.ts() - next + 1));
-                                records[rec.ts() - next] = std::move(rec);
-                            }
-                        });
-                    if (*ts < next) {
-                        break;
-                    }
+                // slices after the gap are rejected as well, resend from what the follower has
+                inflight.clear();
+                sent = acked;
+            } else {
+                retries = 0;
+                sent = std::max(sent, acked);
+            }
+        }
+        return true;
+    }
+
+    // liveness only, records are shipped by replicate_to
+    void heartbeat_to_followers() {
+        for (size_t id = 0; id < options_.members; ++id) {
+            if (id != id_) {
+                auto rpcs = heartbeat_rpc(id);
+                if (!rpcs) {
+                    return;
                 }
+                auto sent = std::chrono::system_clock::now();
+                bus_.send<AppendRpcs, Response>(*rpcs, id, method(kAppendRpcs), options_.heartbeat_timeout)
+                    .subscribe([=, term=rpcs->term()] (bus::ErrorT<Response>& result) {
+                            handle_heartbeat_response(id, term, sent, result);
+                        });
             }
-            uint64_t term;
+        }
+    }
+
+    // the only place new records get their ts: writes come from handler threads through intake_,
+    // so those never wait on state_, and state_ is taken once per batch on a thread of its own core
+    void intake_loop() {
+        constexpr size_t kBatch = 256;
+        if (options_.pin_cores) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(options_.group % std::max(std::thread::hardware_concurrency(), 1u), &cpus);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+                spdlog::warn("failed to pin intake thread of group {0:d}", options_.group);
+            }
+        }
+        std::vector<PendingWrite> batch;
+        while (!stopping_.load()) {
+            batch.clear();
+            if (intake_.pop(batch, kBatch, std::chrono::milliseconds(10)) == 0) {
+                continue;
+            }
+            // give concurrent writers a moment to join the batch
+            auto deadline = std::chrono::steady_clock::now() + options_.coalesce_window;
+            for (auto now = std::chrono::steady_clock::now(); batch.size() < kBatch && now < deadline; now = std::chrono::steady_clock::now()) {
+                intake_.pop(batch, kBatch - batch.size(), deadline - now);
+            }
+            std::optional<ClientResponse> rejection;
+            size_t records = 0;
+            bool flush;
             {
                 auto state = state_.get();
-                term = state->current_term_;
-                if (state->role_ != kLeader) {
-                    return;
+                if (options_.log_memory_limit && state->buffered_bytes_ > options_.log_memory_limit) {
+                    state->trim_log(options_.applied_backlog, options_.log_memory_limit);
                 }
-            }
-            int64_t new_next = next;
-            for (size_t i = 0; i < records.size(); i += options_.rpc_max_batch) {
-                size_t start = i;
-                size_t end = std::min<size_t>(start + options_.rpc_max_batch, records.size());
-                AppendRpcs rpc;
-                rpc.set_term(term);
-                spdlog::debug("sending changelogs from {0:d} to {1:d}", records[start].ts(), records[end - 1].ts());
-                for (size_t j = start; j < end; ++j) {
-                    *rpc.add_records() = std::move(records[j]);
+                if (state->role_ != kLeader || state->applied_ts_ < state->read_barrier_ts_) {
+                    rejection.emplace();
+                    rejection->set_success(false);
+                    if (state->role_ == kFollower && state->leader_id_) {
+                        rejection->set_retry_to(*state->leader_id_);
+                        rejection->set_should_retry(true);
+                    }
+                } else if (options_.log_memory_limit && state->buffered_bytes_ > options_.log_memory_limit) {
+                    // what trim_log left is either not committed yet (quorum is lagging) or not flushed yet
+                    // (the disk is lagging, even with a healthy quorum). The writes fail outright rather than
+                    // pile up: an immediate retry would hit the same cap, backing off is up to the caller
+                    spdlog::debug("rejecting {0:d} writes, in-memory log is {1:d} bytes", batch.size(), state->buffered_bytes_);
+                    rejection.emplace();
+                    rejection->set_success(false);
+                } else {
+                    // consecutive writes share a record up to coalesce_max_bytes, operations keep their order,
+                    // so a later write to the same key still wins
+                    for (size_t begin = 0, end; begin < batch.size(); begin = end) {
+                        LogRecord rec;
+                        size_t bytes = 0;
+                        for (end = begin; end < batch.size(); ++end) {
+                            size_t size = batch[end].record.ByteSizeLong();
+                            if (end > begin && bytes + size > options_.coalesce_max_bytes) {
+                                break;
+                            }
+                            bytes += size;
+                            for (auto& op : *batch[end].record.mutable_operations()) {
+                                *rec.add_operations() = std::move(op);
+                            }
+                        }
+                        rec.set_ts(state->next_ts_++);
+                        rec.set_term(state->current_term_);
+                        std::vector<bus::Promise<ClientResponse>> callers;
+                        for (size_t i = begin; i < end; ++i) {
+                            callers.push_back(std::move(batch[i].promise));
+                        }
+                        bus::Promise<bool> committed;
+                        committed.future().subscribe([callers=std::move(callers)] (bool&) mutable {
+                                ClientResponse response;
+                                response.set_success(true);
+                                for (auto& promise : callers) {
+                                    promise.set_value(response);
+                                }
+                            });
+                        state->commit_subscribers_.push(rec.ts(), std::move(committed));
+                        state->append(std::make_shared<const LogEntry>(std::move(rec)));
+                        ++records;
+                    }
                 }
-                auto response = send<AppendRpcs, Response>(std::move(rpc), node, kAppendRpcs, options_.heartbeat_timeout).wait();
-                if (!response || !response.unwrap().success()) {
-                    spdlog::debug("failing to send changelogs");
-                    return;
+                flush = state->pending_records_ >= options_.flush_max_records || state->pending_bytes_ >= options_.flush_max_bytes;
+            }
+            if (rejection) {
+                for (auto& write : batch) {
+                    write.promise.set_value(*rejection);
                 }
-                new_next = response.unwrap().next_ts();
+                continue;
             }
-            spdlog::info("successful recovery acknowledged timstamp {0:d}", new_next);
-            {
-                auto state = state_.get();
-                state->next_timestamps_[node] = std::max(state->next_timestamps_[node], new_next);
+            spdlog::debug("appended {0:d} client writes as {1:d} records", batch.size(), records);
+            trigger_replication();
+            if (flush) {
+                flusher_.trigger();
             }
-        };
+        }
+    }
 
-        for (size_t i = 0; i < nodes.size(); ++i) {
-            recover_node(nodes[i], nexts[i]);
+    void trigger_replication() {
+        for (auto& replicator : replicators_) {
+            if (replicator) {
+                replicator->trigger();
+            }
         }
     }
 
-    void heartbeat_to_followers() {
-        std::vector<uint64_t> endpoints;
-        std::vector<AppendRpcs> messages;
+    void replicate_to(size_t id) {
+        std::vector<std::vector<LogEntryPtr>> batches;
+        std::vector<int64_t> prev_terms;
+        uint64_t term;
+        uint64_t epoch;
+        int64_t applied_ts;
         {
             auto state = state_.get();
             if (state->role_ != kLeader) {
                 return;
             }
+            term = state->current_term_;
+            epoch = state->pipeline_epochs_[id];
+            applied_ts = state->applied_ts_;
+
+            // batches are sent optimistically up to the window, next_timestamps_ only moves on acknowledgement
+            ssize_t next_ts = std::max(state->sent_timestamps_[id], state->next_timestamps_[id]);
+            int64_t prev_term = state->term_at(next_ts - 1).value_or(0);
+            while (state->inflight_batches_[id] < options_.max_inflight_batches) {
+                std::vector<LogEntryPtr> batch;
+                if (state->buffered_log_.size() > 0 && next_ts >= state->buffered_log_[0]->ts()) {
+                    const size_t start_ts = state->buffered_log_[0]->ts();
+                    const size_t start_index = next_ts - start_ts;
+                    for (size_t i = start_index; i < state->buffered_log_.size() && batch.size() < options_.rpc_max_batch; ++i) {
+                        batch.push_back(state->buffered_log_[i]);
+                    }
+                }
+                if (batch.empty()) {
+                    break;
+                }
+                spdlog::debug("sending to {0:d} {1:d} records", id, batch.size());
+                next_ts = batch.back()->ts() + 1;
+                ++state->inflight_batches_[id];
+                prev_terms.push_back(prev_term);
+                prev_term = batch.back()->record.term();
+                batches.push_back(std::move(batch));
+            }
+            state->sent_timestamps_[id] = next_ts;
+        }
+        // entries are only referenced under the lock, bytes are copied outside of it
+        for (size_t i = 0; i < batches.size(); ++i) {
+            auto& batch = batches[i];
+            AppendRpcsRaw rpcs;
+            rpcs.set_term(term);
+            rpcs.set_applied_ts(applied_ts);
+            rpcs.set_prev_ts(batch[0]->ts() - 1);
+            rpcs.set_prev_term(prev_terms[i]);
+            for (auto& entry : batch) {
+                rpcs.add_records(entry->serialized);
+            }
+            int64_t last_ts = batch.back()->ts();
+            auto sent = std::chrono::system_clock::now();
+            bus_.send<AppendRpcsRaw, Response>(std::move(rpcs), id, method(kAppendRpcs), options_.heartbeat_timeout)
+                .subscribe([=] (bus::ErrorT<Response>& result) {
+                        handle_append_response(id, term, epoch, last_ts, sent, result);
+                    });
+        }
+    }
 
-            for (size_t id = 0; id < options_.members; ++id) {
-                ssize_t next_ts = state->next_timestamps_[id];
-                if (id == id_) {
-                    continue;
+    // last_ts is -1 for heartbeats
+    void handle_append_response(size_t id, uint64_t term, uint64_t epoch, int64_t last_ts,
+            std::chrono::system_clock::time_point sent, bus::ErrorT<Response>& result)
+    {
+        bool to_log = last_ts >= 0;
+        std::vector<bus::Promise<bool>> subscribers;
+        bool resend = false;
+        {
+            auto state = state_.get();
+            bool current = to_log && state->current_term_ == term && state->pipeline_epochs_[id] == epoch;
+            if (current) {
+                --state->inflight_batches_[id];
+            }
+            if (result && result.unwrap().success()) {
+                auto& response = result.unwrap();
+                state->next_timestamps_[id] = std::max(state->next_timestamps_[id], response.next_ts());
+                state->durable_timestamps_[id] = response.durable_ts();
+                state->follower_heartbeats_[id] = sent;
+                if (to_log) {
+                    spdlog::debug("node {2:d} responded with next_ts={0:d} durable_ts={1:d}", response.next_ts(), response.durable_ts(), id);
                 }
-                endpoints.push_back(id);
-                AppendRpcs rpcs;
-                rpcs.set_term(state->current_term_);
-                rpcs.set_applied_ts(state->applied_ts_);
-                if (state->buffered_log_.size() > 0 && next_ts >= state->buffered_log_[0].ts()) {
-                    const size_t start_ts = state->buffered_log_[0].ts();
-                    const size_t start_index = next_ts - start_ts;
-                    for (size_t i = start_index; i < state->buffered_log_.size() && rpcs.records_size() < options_.rpc_max_batch; ++i) {
-                        *rpcs.add_records() = state->buffered_log_[i];
+                if (current && response.next_ts() <= last_ts) {
+                    // batch was not appended (gap or conflict), resend from follower's position
+                    int64_t next_ts = response.next_ts();
+                    if (response.conflict_term()) {
+                        next_ts = state->resend_from(next_ts, response.conflict_term(), last_ts);
                     }
+                    state->rollback_pipeline(id, next_ts);
                 }
-                if (rpcs.records_size()) {
-                    spdlog::debug("sending to {0:d} {1:d} records", id, rpcs.records_size());
+                // a late response must not commit anything once this node stepped down or moved on
+                if (state->role_ == kLeader && state->current_term_ == term) {
+                    state->advance_applied_timestamp();
+                    subscribers = state->pick_subscribers();
+                    update_lease(*state);
+                }
+            } else {
+                spdlog::debug("node {0:d} failed heartbeat", id);
+                if (current) {
+                    state->rollback_pipeline(id, state->next_timestamps_[id]);
                 }
-                messages.push_back(std::move(rpcs));
             }
+            resend = current && state->role_ == kLeader;
         }
-        for (size_t i = 0; i < endpoints.size(); ++i) {
-            bool to_log = messages[i].records_size() > 0;
-            send<AppendRpcs, Response>(std::move(messages[i]), endpoints[i], kAppendRpcs, options_.heartbeat_timeout)
-                .subscribe([=, id=endpoints[i]] (bus::ErrorT<Response>& result) {
-                        std::vector<bus::Promise<bool>> subscribers;
-                        if (result) {
-                            auto& response = result.unwrap();
-                            auto state = state_.get();
-                            if (response.success()) {
-                                state->next_timestamps_[id] = response.next_ts();
-                                state->durable_timestamps_[id] = response.durable_ts();
-                                state->follower_heartbeats_[id] = std::chrono::system_clock::now();
-                                if (to_log) {
-                                    spdlog::debug("node {2:d} responded with next_ts={0:d} durable_ts={1:d}", response.next_ts(), response.durable_ts(), id);
-                                }
-                                state->advance_applied_timestamp();
-                                subscribers = state->pick_subscribers();
-                            } else {
-                                spdlog::debug("node {0:d} failed heartbeat", id);
-                            }
-                        }
-                        for (auto& f : subscribers) {
-                            f.set_value(true);
-                        }
-                    } );
+        for (auto& f : subscribers) {
+            f.set_value(true);
+        }
+        if (resend) {
+            replicators_[id]->trigger();
         }
     }
 
     static constexpr std::string_view changelog_fname_prefix = "changelog.";
     static constexpr std::string_view snapshot_fname_prefix = "snapshot.";
+    static constexpr std::string_view delta_fname_prefix = "delta.";
 
     std::string changelog_name(size_t number) {
         std::stringstream ss;
@@ -849,6 +2053,14 @@ private:
         return path.string();
     }
 
+    std::string delta_name(size_t number) {
+        std::stringstream ss;
+        ss << delta_fname_prefix << number;
+        std::filesystem::path path = options_.dir;
+        path /= ss.str();
+        return path.string();
+    }
+
     static std::optional<size_t> parse_name(std::string_view prefix, std::string fname) {
         if (fname.substr(0, prefix.size()) == prefix) {
             auto suffix = fname = fname.substr(prefix.size());
@@ -871,37 +2083,48 @@ private:
         return parse_name(snapshot_fname_prefix, std::move(fname));
     }
 
+    static std::optional<size_t> parse_delta_name(std::string fname) {
+        return parse_name(delta_fname_prefix, std::move(fname));
+    }
+
     void flush() {
-        std::vector<LogRecord> to_flush;
+        std::vector<LogEntryPtr> to_flush;
         bus::Promise<bool> to_deliver;
         // we want log records to be consecutive
         auto log = log_.get();
-        size_t durable_ts;
+        int64_t durable_ts;
+        size_t bytes;
 
         {
             auto state = state_.get();
             auto& log = state->buffered_log_;
-            size_t i = 0;
-            while (i < log.size() && log[i].ts() + options_.applied_backlog <= state->applied_ts_) {
-                ++i;
-            }
-            to_flush.insert(to_flush.begin(), log.begin() + state->flushed_index_, log.end());
-            if (i > 0) {
-                spdlog::debug("erased up to ts={0:d} record", state->buffered_log_[i - 1].ts());
+            for (size_t i = state->flushed_index_; i < log.size(); ++i) {
+                to_flush.push_back(log[i]);
             }
-            log.erase(log.begin(), log.begin() + i);
             state->flushed_index_ = log.size();
+            state->trim_log(options_.applied_backlog, options_.log_memory_limit);
+            bytes = state->pending_bytes_;
+            state->pending_records_ = state->pending_bytes_ = 0;
             to_deliver.swap(state->flush_event_);
-            durable_ts = !state->buffered_log_.empty() ? state->buffered_log_.back().ts() : state->durable_ts_;
+            durable_ts = !state->buffered_log_.empty() ? state->buffered_log_.back()->ts() : state->durable_ts_;
         }
 
         if (to_flush.size()) {
-            spdlog::debug("write from {0:d} to {1:d} to changelog", to_flush[0].ts(), to_flush.back().ts());
-        }
-        for (auto& record : to_flush) {
-            log->write_log_record(record);
+            spdlog::debug("write from {0:d} to {1:d} to changelog", to_flush[0]->ts(), to_flush.back()->ts());
+            for (auto& entry : to_flush) {
+                log->append(entry->ts(), entry->serialized);
+            }
+            log->sync(shared_sync_);
+            if (log->size() >= options_.changelog_segment_size) {
+                auto state = state_.get();
+                log->open(open(changelog_name(++state->current_changelog_).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR), durable_ts);
+            }
+            flush_stats_.fsyncs.fetch_add(1);
+            flush_stats_.records.fetch_add(to_flush.size());
+            flush_stats_.bytes.fetch_add(bytes);
+        } else {
+            flush_stats_.skipped.fetch_add(1);
         }
-        log->sync();
 
         std::vector<bus::Promise<bool>> subscribers;
         {
@@ -919,32 +2142,340 @@ private:
         to_deliver.set_value_once(true);
     }
 
-    bool read_snapshot(BufferedFile& io, int number, int64_t& ts, std::map<std::string, std::string>& fsm) {
-        auto fname = snapshot_name(number);
-        io.set_fd(open(fname.c_str(), O_RDONLY));
-        bool valid = true;
-        std::optional<uint64_t> size = io.read_int64();
-        std::optional<uint64_t> applied = io.read_int64();
-        if (!size.has_value() || !applied.has_value()) {
+    // snapshot layout: uint64 records, int64 applied ts, single operation records in BufferedFile framing.
+    // A base (snapshot.<ts>) holds the whole state, a delta (delta.<ts>) has one more int64 after
+    // applied ts, the ts of the base or delta it applies on top of, and holds only keys set since then.
+    static constexpr size_t kSnapshotHeader = 2 * sizeof(int64_t);
+    static constexpr size_t kDeltaHeader = 3 * sizeof(int64_t);
+
+    // record boundaries are found by a sequential hop over size prefixes,
+    // crc checks and parsing run on recovery_threads while the previous round is applied
+    bool read_snapshot(const std::string& fname, size_t header, int64_t& ts, StateMachine& fsm) {
+        constexpr size_t kBatch = 1 << 14;
+        MappedFile file(fname);
+        size_t end = file.size();
+        if (end < header) {
             return false;
         }
-        ts = *applied;
-        for (uint64_t i = 0; i < *size; ++i) {
-            if (auto record = io.read_log_record()) {
-                for (auto& op : record->operations()) {
-                    fsm[op.key()] = op.value();
-                }
-            } else {
+        uint64_t size = file.load<uint64_t>(0);
+        ts = file.load<int64_t>(sizeof(int64_t));
+        fsm.reserve(size);
+
+        std::atomic<bool> valid = true;
+        std::future<void> applying;
+        size_t position = header;
+        for (uint64_t done = 0; done < size && valid;) {
+            size_t round = std::min<uint64_t>(size - done, kBatch * std::max<size_t>(options_.recovery_threads, 1));
+            std::vector<size_t> offsets;
+            offsets.reserve(round);
+            for (size_t i = 0; i < round && position + BufferedFile::kRecordHeader <= end; ++i) {
+                offsets.push_back(position);
+                position += BufferedFile::kRecordHeader + file.load<uint32_t>(position);
+            }
+            if (offsets.size() < round) {
+                valid = false;
+                break;
+            }
+            std::vector<std::vector<LogRecord>> batches((round + kBatch - 1) / kBatch);
+            parallel_for(batches.size(), options_.recovery_threads, [&](size_t batch) {
+                    size_t last = std::min(round, (batch + 1) * kBatch);
+                    batches[batch].resize(last - batch * kBatch);
+                    for (size_t i = batch * kBatch; i < last; ++i) {
+                        auto data = unframe_record(file, offsets[i], end);
+                        if (!data || !batches[batch][i - batch * kBatch].ParseFromArray(data->data(), data->size())) {
+                            valid = false;
+                            return;
+                        }
+                    }
+                });
+            if (applying.valid()) {
+                applying.get();
+            }
+            if (!valid) {
+                break;
+            }
+            applying = std::async(std::launch::async, [&fsm, batches = std::move(batches)] {
+                    for (auto& batch : batches) {
+                        for (auto& record : batch) {
+                            fsm.load(record);
+                        }
+                    }
+                });
+            done += round;
+        }
+        if (applying.valid()) {
+            applying.get();
+        }
+        return valid;
+    }
+
+    // sequential pass over a base or a delta, false if it is torn or corrupted
+    template<typename F>
+    static bool scan_snapshot(const MappedFile& file, size_t header, F&& f) {
+        if (file.size() < header) {
+            return false;
+        }
+        uint64_t size = file.load<uint64_t>(0);
+        size_t position = header;
+        for (uint64_t i = 0; i < size; ++i) {
+            auto data = unframe_record(file, position, file.size());
+            LogRecord record;
+            if (!data || !record.ParseFromArray(data->data(), data->size())) {
                 return false;
             }
+            f(record, *data);
+            position += BufferedFile::kRecordHeader + data->size();
         }
         return true;
     }
 
-    void iterate_changelog(BufferedFile& io, std::function<void(LogRecord)> consumer) {
-        while (auto rec = io.read_log_record()) {
-            consumer(std::move(*rec));
+    static void write_snapshot_op(BufferedFile& file, std::string_view key, std::string_view value) {
+        LogRecord record;
+        auto* op = record.add_operations();
+        op->set_key(key.data(), key.size());
+        op->set_value(value.data(), value.size());
+        file.write_log_record(record);
+    }
+
+    // deltas to apply on top of the base or delta taken at ts, in order
+    std::vector<size_t> delta_chain(int64_t ts) {
+        std::map<int64_t, size_t> next;
+        for (size_t number : discover_deltas()) {
+            MappedFile file(delta_name(number));
+            if (file.size() >= kDeltaHeader) {
+                auto& delta = next[file.load<int64_t>(kSnapshotHeader)];
+                delta = std::max(delta, number);
+            }
+        }
+        std::vector<size_t> chain;
+        for (auto it = next.find(ts); it != next.end(); it = next.find(it->second)) {
+            chain.push_back(it->second);
+        }
+        return chain;
+    }
+
+    // newest readable base and the deltas on top of it, returns the ts fsm ends up at
+    int64_t load_snapshots(StateMachine& fsm) {
+        std::shared_lock lock(snapshot_files_mutex_);
+        auto snapshots = discover_snapshots();
+        int64_t ts = -1;
+        while (!snapshots.empty()) {
+            if (read_snapshot(snapshot_name(snapshots.back()), kSnapshotHeader, ts, fsm)) {
+                break;
+            }
+            spdlog::warn("snapshot {0:d} is corrupted", snapshots.back());
+            snapshots.pop_back();
+            fsm.clear();
+            ts = -1;
+        }
+        auto chain = delta_chain(ts);
+        for (size_t i = 0; i < chain.size(); ++i) {
+            if (!read_snapshot(delta_name(chain[i]), kDeltaHeader, ts, fsm)) {
+                // the bad delta is partially applied, start over without it
+                spdlog::warn("delta {0:d} is corrupted, dropping it and {1:d} later ones", chain[i], chain.size() - i - 1);
+                fsm.clear();
+                ts = -1;
+                if (!snapshots.empty()) {
+                    FATAL(!read_snapshot(snapshot_name(snapshots.back()), kSnapshotHeader, ts, fsm));
+                }
+                for (size_t j = 0; j < i; ++j) {
+                    FATAL(!read_snapshot(delta_name(chain[j]), kDeltaHeader, ts, fsm));
+                }
+                break;
+            }
+        }
+        return ts;
+    }
+
+    // streams the open fsm view; written under a temporary name and renamed, so a torn file is never picked up
+    void write_delta(int64_t ts, int64_t base_ts, size_t size) {
+        auto fname = delta_name(ts);
+        auto tmp_name = fname + ".tmp";
+        BufferedFile delta{open(tmp_name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)};
+        delta.write_int64(size);
+        delta.write_int64(ts);
+        delta.write_int64(base_ts);
+        fsm_.for_each_in_view([&](std::string_view key, std::string_view value) {
+            write_snapshot_op(delta, key, value);
+        });
+        delta.sync();
+        FATAL(rename(tmp_name.c_str(), fname.c_str()) != 0);
+    }
+
+    // folds the newest base and its deltas into a new base at the last delta's ts
+    // (on rotation once there are max_snapshot_deltas of them, or forced before sending a snapshot):
+    // deltas are loaded in memory, the base is streamed and untouched records are copied as is
+    void merge_snapshots(bool force = false) {
+        std::lock_guard guard(merge_mutex_);
+        auto snapshots = discover_snapshots();
+        int64_t base_ts = snapshots.empty() ? -1 : snapshots.back();
+        auto chain = delta_chain(base_ts);
+        if (chain.empty() || (!force && chain.size() < options_.max_snapshot_deltas)) {
+            return;
+        }
+        std::unordered_map<std::string, std::string> updates;
+        for (size_t number : chain) {
+            MappedFile file(delta_name(number));
+            bool valid = scan_snapshot(file, kDeltaHeader, [&](const LogRecord& record, std::string_view) {
+                    for (auto& op : record.operations()) {
+                        updates[op.key()] = op.value();
+                    }
+                });
+            if (!valid) {
+                spdlog::warn("delta {0:d} is corrupted, not merging", number);
+                return;
+            }
+        }
+
+        int64_t ts = chain.back();
+        auto fname = snapshot_name(ts);
+        auto tmp_name = fname + ".tmp";
+        BufferedFile snapshot{open(tmp_name.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)};
+        uint64_t size = 0;
+        snapshot.write_int64(size);
+        snapshot.write_int64(ts);
+        if (base_ts >= 0) {
+            MappedFile file(snapshot_name(base_ts));
+            bool valid = scan_snapshot(file, kSnapshotHeader, [&](const LogRecord& record, std::string_view data) {
+                    if (record.operations_size() == 1 && !updates.count(record.operations(0).key())) {
+                        snapshot.write_record(data);
+                        ++size;
+                        return;
+                    }
+                    for (auto& op : record.operations()) {
+                        if (auto it = updates.find(op.key()); it != updates.end()) {
+                            write_snapshot_op(snapshot, it->first, it->second);
+                            updates.erase(it);
+                        } else {
+                            write_snapshot_op(snapshot, op.key(), op.value());
+                        }
+                        ++size;
+                    }
+                });
+            if (!valid) {
+                spdlog::warn("snapshot {0:d} is corrupted, not merging", base_ts);
+                snapshot.close();
+                unlink(tmp_name.c_str());
+                return;
+            }
+        }
+        for (auto& [key, value] : updates) {
+            write_snapshot_op(snapshot, key, value);
+            ++size;
+        }
+        snapshot.write_int64_at(0, size);
+        snapshot.sync();
+
+        std::unique_lock lock(snapshot_files_mutex_);
+        FATAL(rename(tmp_name.c_str(), fname.c_str()) != 0);
+        for (size_t number : snapshots) {
+            unlink(snapshot_name(number).c_str());
+        }
+        for (size_t number : discover_deltas()) {
+            if (int64_t(number) <= ts) {
+                unlink(delta_name(number).c_str());
+            }
+        }
+        spdlog::info("merged snapshot {0:d} and {1:d} deltas into ts={2:d} with {3:d} keys", base_ts, chain.size(), ts, size);
+    }
+
+    // changelog segments that may hold records from from_ts on, oldest first and positioned before it
+    std::pair<std::vector<size_t>, std::vector<std::unique_ptr<ChangelogReader>>> open_changelogs(int64_t from_ts) {
+        // the open segment has no footer yet, the writer's index is used to skip its head instead
+        std::optional<std::pair<size_t, uint64_t>> open_segment;
+        {
+            auto log = log_.get();
+            if (auto offset = log->offset_of(from_ts)) {
+                open_segment = { state_.get()->current_changelog_, *offset };
+            }
+        }
+        auto changelogs = discover_changelogs();
+        std::vector<size_t> numbers;
+        std::vector<std::unique_ptr<ChangelogReader>> readers;
+        for (auto it = changelogs.rbegin(); it != changelogs.rend(); ++it) {
+            auto reader = std::make_unique<ChangelogReader>(changelog_name(*it));
+            auto ts = reader->limit_ts();
+            if (!ts) {
+                continue;
+            }
+            spdlog::debug("opened changelog {1:d} limit ts={0:d}", *ts, *it);
+            reader->seek(from_ts);
+            if (open_segment && open_segment->first == *it) {
+                reader->seek_offset(open_segment->second);
+            }
+            numbers.push_back(*it);
+            readers.push_back(std::move(reader));
+            if (*ts < from_ts) {
+                break;
+            }
+        }
+        std::reverse(numbers.begin(), numbers.end());
+        std::reverse(readers.begin(), readers.end());
+        return { std::move(numbers), std::move(readers) };
+    }
+
+    // replay in file order: a record overrides everything written after its ts before it
+    template<typename T, typename TsOf>
+    static std::vector<T> replay_changelogs(std::vector<std::vector<T>>& segments, int64_t from_ts, TsOf ts_of) {
+        std::vector<T> log;
+        for (auto& segment : segments) {
+            for (auto& item : segment) {
+                int64_t ts = ts_of(item);
+                if (ts < from_ts) {
+                    log.clear();
+                    continue;
+                }
+                size_t index = ts - from_ts;
+                if (index > log.size()) {
+                    // log has to stay a prefix
+                    spdlog::warn("changelog gap at ts={0:d}, dropping later records", from_ts + log.size());
+                    return log;
+                }
+                log.resize(index);
+                log.push_back(std::move(item));
+            }
         }
+        return log;
+    }
+
+    // log from from_ts on assembled from changelog segments decoded on recovery_threads;
+    // torn segment tails are cut off on disk when truncate_corrupted is set
+    std::vector<LogEntryPtr> read_changelogs(int64_t from_ts, bool truncate_corrupted) {
+        auto changelogs = open_changelogs(from_ts);
+        auto& numbers = changelogs.first;
+        auto& readers = changelogs.second;
+        std::vector<std::vector<LogEntryPtr>> segments(readers.size());
+        parallel_for(readers.size(), options_.recovery_threads, [&](size_t i) {
+                while (auto entry = readers[i]->next()) {
+                    segments[i].push_back(std::move(entry));
+                }
+            });
+        for (size_t i = 0; i < readers.size(); ++i) {
+            if (truncate_corrupted && readers[i]->corrupted()) {
+                // nothing after a torn write can be trusted
+                spdlog::warn("truncating changelog {0:d} at bad record offset={1:d}", numbers[i], readers[i]->position());
+                FATAL(truncate(changelog_name(numbers[i]).c_str(), readers[i]->position()) != 0);
+            }
+        }
+        return replay_changelogs(segments, from_ts, [](const LogEntryPtr& entry) { return entry->ts(); });
+    }
+
+    // same log as read_changelogs, but only record locations are kept, so a long log can be sent
+    // in windows with the segments decoded once
+    ChangelogIndex index_changelogs(int64_t from_ts) {
+        ChangelogIndex index;
+        index.readers = std::move(open_changelogs(from_ts).second);
+        std::vector<std::vector<ChangelogIndex::Location>> segments(index.readers.size());
+        parallel_for(index.readers.size(), options_.recovery_threads, [&](size_t i) {
+                auto& reader = *index.readers[i];
+                size_t offset = reader.position();
+                while (auto entry = reader.next()) {
+                    segments[i].push_back({ entry->ts(), i, offset });
+                    offset = reader.position();
+                }
+            });
+        index.log = replay_changelogs(segments, from_ts, [](const ChangelogIndex::Location& location) { return location.ts; });
+        return index;
     }
 
     std::vector<size_t> discover_snapshots() {
@@ -958,6 +2489,17 @@ private:
         return snapshots;
     }
 
+    std::vector<size_t> discover_deltas() {
+        std::vector<size_t> deltas;
+        for (auto entry : std::filesystem::directory_iterator(options_.dir)) {
+            if (auto number = parse_delta_name(entry.path().filename())) {
+                deltas.push_back(*number);
+            }
+        }
+        std::sort(deltas.begin(), deltas.end());
+        return deltas;
+    }
+
     std::vector<size_t> discover_changelogs() {
         std::vector<size_t> changelogs;
         for (auto entry : std::filesystem::directory_iterator(options_.dir)) {
@@ -970,54 +2512,32 @@ private:
     }
 
     void recover() {
-        auto state = state_.get();
         std::vector<size_t> snapshots = discover_snapshots();
         std::vector<size_t> changelogs = discover_changelogs();
+
+        // files are read before taking the state lock
+        int64_t applied_ts = load_snapshots(fsm_);
+        auto log = read_changelogs(applied_ts + 1, true);
+
+        auto state = state_.get();
         if (!snapshots.empty()) {
             state->current_changelog_ = std::max(state->current_changelog_, snapshots.back() + 1);
         }
         if (!changelogs.empty()) {
             state->current_changelog_ = std::max(state->current_changelog_, changelogs.back() + 1);
         }
-
-        BufferedFile io;
-        while (!snapshots.empty()) {
-            if (read_snapshot(io, snapshots.back(), state->applied_ts_, state->fsm_)) {
-                state->durable_ts_ = state->applied_ts_;
-                state->next_ts_ = state->applied_ts_ + 1;
-                break;
-            } else {
-                snapshots.pop_back();
-                state->fsm_.clear();
-            }
-        }
-
-        size_t first_changelog = 0;
-        std::reverse(changelogs.begin(), changelogs.end());
-        for (auto changelog : changelogs) {
-            auto fname = changelog_name(changelog);
-            io.set_fd(open(fname.c_str(), O_RDONLY));
-            auto ts = io.read_int64();
-            if (ts) {
-                spdlog::debug("opened changelog {1:d} limit ts={0:d}", *ts, changelog);
-            }
-            iterate_changelog(io,
-                [&](auto rec) {
-                    if (rec.ts() > state->applied_ts_) {
-                        state->buffered_log_.resize(std::max<size_t>(state->buffered_log_.size(), rec.ts() - state->applied_ts_));
-                        state->buffered_log_[rec.ts() - state->applied_ts_ - 1] = rec;
-                        state->next_ts_ = std::max<size_t>(state->next_ts_, rec.ts() + 1);
-                        state->durable_ts_ = std::max<ssize_t>(state->durable_ts_, rec.ts());
-                    }
-                });
-            if (*ts <= state->applied_ts_) {
-                break;
-            }
+        state->applied_ts_ = state->snapshot_ts_ = applied_ts;
+        state->durable_ts_ = log.empty() ? applied_ts : log.back()->ts();
+        state->next_ts_ = state->durable_ts_ + 1;
+        state->buffered_log_.clear();
+        state->buffered_bytes_ = 0;
+        for (auto& entry : log) {
+            state->buffered_bytes_ += entry->serialized.size();
+            state->buffered_log_.push_back(std::move(entry));
         }
         {
             auto log = log_.get();
-            log->set_fd(open(changelog_name(state->current_changelog_).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR));
-            log->write_int64(state->durable_ts_);
+            log->open(open(changelog_name(state->current_changelog_).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR), state->durable_ts_);
         }
         if (auto vote = vote_keeper_.get()->recover()) {
             state->current_term_ = vote->term();
@@ -1027,62 +2547,83 @@ private:
     }
 
     void rotate() {
-        uint64_t snapshot_number;
+        if (auto fsyncs = flush_stats_.fsyncs.load()) {
+            spdlog::info("group commit: {0:d} fsyncs, {1:.2f} records and {2:d} bytes per fsync, {3:d} idle flushes skipped",
+                    fsyncs, double(flush_stats_.records.load()) / fsyncs, flush_stats_.bytes.load() / fsyncs, flush_stats_.skipped.load());
+        }
+        int64_t snapshot_ts;
+        int64_t base_ts;
+        size_t delta_size;
         // sync calls under lock cos don't want to deal with partial states
         {
             auto log = log_.get();
             auto state = state_.get();
-            if (state->applied_ts_ < 0) {
+            if (state->applied_ts_ <= state->snapshot_ts_) {
                 return;
             }
-            snapshot_number = state->applied_ts_;
-            log->set_fd(open(changelog_name(++state->current_changelog_).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR));
-            log->write_int64(state->durable_ts_);
-        }
-        // here we go dumpin'
-        BufferedFile snapshot{open(snapshot_name(snapshot_number).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR)};
-        State& unsafe_state_ptr = *state_.get();
-        bus::SharedView preallocated_arena_buf(buffer_pool_, options_.bus_options.tcp_opts.max_message_size);
-        if (pid_t child = fork()) {
-            FATAL(child < 0);
-            int wstatus;
-            pid_t exited = waitpid(child, &wstatus, 0);
-            FATAL(child != exited);
-            FATAL(WEXITSTATUS(wstatus) != 0);
-        } else {
-            State& state = unsafe_state_ptr;
-            snapshot.write_int64(state.fsm_.size());
-            snapshot.write_int64(state.applied_ts_);
-            uint64_t applied_ts = state.applied_ts_;
-            for (auto [k, v] : state.fsm_) {
-                google::protobuf::ArenaOptions options;
-                options.initial_block = preallocated_arena_buf.data();
-                options.initial_block_size = preallocated_arena_buf.size();
-                google::protobuf::Arena arena(options);
-                LogRecord* record = google::protobuf::Arena::CreateMessage<LogRecord>(&arena);
-                auto* op = record->add_operations();
-                op->set_key(k);
-                op->set_value(v);
-                snapshot.write_log_record(*record);
-            }
-            snapshot.sync();
-            _exit(0);
+            snapshot_ts = state->applied_ts_;
+            base_ts = state->snapshot_ts_;
+            state->snapshot_ts_ = snapshot_ts;
+            delta_size = fsm_.open_view();
+            log->open(open(changelog_name(++state->current_changelog_).c_str(), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR), state->durable_ts_);
         }
+        // apply goes on meanwhile
+        write_delta(snapshot_ts, base_ts, delta_size);
+        fsm_.close_view();
+        spdlog::debug("written delta ts={0:d} on top of ts={1:d} with {2:d} keys", snapshot_ts, base_ts, delta_size);
+        merge_snapshots();
     }
 
 private:
+    RaftTransport& bus_;
+    SharedSync* shared_sync_;
     bus::internal::ExclusiveWrapper<VoteKeeper> vote_keeper_;
-    bus::BufferPool buffer_pool_;
     Options options_;
+    StateMachine fsm_;
     bus::internal::ExclusiveWrapper<State> state_;
+    // system_clock rep, leader serves reads without State lock until then
+    std::atomic<duration::rep> lease_expiry_ = std::numeric_limits<duration::rep>::min();
 
     bus::internal::PeriodicExecutor elector_;
     bus::internal::PeriodicExecutor flusher_;
     bus::internal::PeriodicExecutor rotator_;
     bus::internal::PeriodicExecutor sender_;
     bus::internal::PeriodicExecutor stale_nodes_agent_;
+    // per follower, woken by new records and acknowledgements
+    std::vector<std::unique_ptr<bus::internal::PeriodicExecutor>> replicators_;
 
-    bus::internal::ExclusiveWrapper<BufferedFile> log_;
+    RateLimiter recovery_limiter_;
+
+    // client writes on their way to intake_loop
+    struct PendingWrite {
+        LogRecord record;
+        bus::Promise<ClientResponse> promise;
+    };
+    IntakeQueue<PendingWrite> intake_;
+    std::thread intake_thread_;
+    std::atomic<bool> stopping_ = false;
+
+    // snapshot being received from the leader: (term, applied ts), file size and bytes written in order
+    struct SnapshotReceiver {
+        DescriptorHolder fd_;
+        std::optional<std::pair<int64_t, int64_t>> id_;
+        uint64_t size_ = 0;
+        uint64_t received_ = 0;
+    };
+    bus::internal::ExclusiveWrapper<SnapshotReceiver> snapshot_receiver_;
+
+    bus::internal::ExclusiveWrapper<ChangelogWriter> log_;
+    // merge_snapshots replaces files readers may be about to open
+    std::shared_mutex snapshot_files_mutex_;
+    // rotator and stale followers recovery both merge
+    std::mutex merge_mutex_;
+
+    struct FlushStats {
+        std::atomic<uint64_t> fsyncs = 0;
+        std::atomic<uint64_t> records = 0;
+        std::atomic<uint64_t> bytes = 0;
+        std::atomic<uint64_t> skipped = 0;
+    } flush_stats_;
 
     uint64_t id_;
     uint64_t snapshot_id = 0;
@@ -1090,6 +2631,157 @@ private:
     bus::internal::Event shot_down_;
 };
 
+// options.groups independent raft groups on one transport, each with its own log, state machine and leader,
+// in options.dir/group.<g>. Group g uses methods (g + 1) * kGroupMethods + k*; the legacy kClientReq id
+// routes client requests by key, and one GroupHeartbeats message per follower carries all groups' heartbeats.
+// Requests spanning several groups are split and are not atomic across them.
+class RaftGroups {
+private:
+    enum {
+        kClientReq = RaftNode::kClientReq,
+        kGroupHeartbeats = 6
+    };
+
+public:
+    RaftGroups(RaftTransport& bus, RaftNode::Options options)
+        : bus_(bus)
+        , options_(options)
+        , sender_([this] { heartbeat_to_followers(); }, options.heartbeat_interval)
+    {
+        id_ = *options.bus_options.greeter;
+        for (size_t group = 0; group < options.groups; ++group) {
+            auto group_options = options;
+            group_options.dir = options.dir / ("group." + std::to_string(group));
+            std::filesystem::create_directories(group_options.dir);
+            group_options.method_base = (group + 1) * RaftNode::kGroupMethods;
+            group_options.batched_heartbeats = true;
+            group_options.group = group;
+            groups_.push_back(std::make_unique<RaftNode>(bus, group_options, &sync_));
+        }
+        bus_.register_handler<ClientRequest, ClientResponse>(kClientReq, [this](int node, ClientRequest req) {
+            return handle_client_request(node, std::move(req));
+        });
+        bus_.register_handler<GroupHeartbeats, GroupResponses>(kGroupHeartbeats, [this](int node, GroupHeartbeats msg) {
+            return bus::make_future(handle_heartbeats(node, std::move(msg)));
+        });
+    }
+
+    void start() {
+        for (auto& group : groups_) {
+            group->start();
+        }
+        sender_.delayed_start();
+    }
+
+    size_t route(std::string_view key) const {
+        return std::hash<std::string_view>()(key) % groups_.size();
+    }
+
+    bus::internal::Event& shot_down() {
+        return groups_[0]->shot_down();
+    }
+
+private:
+    bus::Future<ClientResponse> handle_client_request(int node, ClientRequest req) {
+        std::map<size_t, ClientRequest> parts;
+        for (auto& op : req.operations()) {
+            *parts[route(op.key())].add_operations() = op;
+        }
+        if (parts.size() <= 1) {
+            // a redirect to the group leader goes back to the client as is
+            return groups_[parts.empty() ? 0 : parts.begin()->first]->handle_client_request(node, std::move(req));
+        }
+        ClientResponse merged;
+        merged.set_success(true);
+        auto result = bus::make_future(std::move(merged));
+        for (auto& [group, part] : parts) {
+            auto response = execute(node, group, std::move(part));
+            result = result.chain([response](ClientResponse& merged) mutable {
+                    return response.map([merged](ClientResponse& part) mutable {
+                            merged.set_success(merged.success() && part.success());
+                            merged.set_should_retry(merged.should_retry() || part.should_retry());
+                            for (auto& entry : part.entries()) {
+                                *merged.add_entries() = entry;
+                            }
+                            return merged;
+                        });
+                });
+        }
+        return result;
+    }
+
+    // runs a single group part locally, or on the group leader if this node is not it
+    bus::Future<ClientResponse> execute(int node, size_t group, ClientRequest req) {
+        return groups_[group]->handle_client_request(node, req)
+            .chain([this, group, req](ClientResponse& response) mutable {
+                    if (response.success() || !response.should_retry() || response.retry_to() == id_) {
+                        return bus::make_future(std::move(response));
+                    }
+                    return bus_.send<ClientRequest, ClientResponse>(std::move(req), response.retry_to(), groups_[group]->method(kClientReq), options_.heartbeat_timeout)
+                        .map([](bus::ErrorT<ClientResponse>& result) {
+                                if (result) {
+                                    return result.unwrap();
+                                }
+                                ClientResponse response;
+                                response.set_success(false);
+                                response.set_should_retry(true);
+                                return response;
+                            });
+                });
+    }
+
+    void heartbeat_to_followers() {
+        for (size_t id = 0; id < options_.members; ++id) {
+            if (id == id_) {
+                continue;
+            }
+            GroupHeartbeats msg;
+            for (size_t group = 0; group < groups_.size(); ++group) {
+                if (auto rpcs = groups_[group]->heartbeat_rpc(id)) {
+                    msg.add_groups(group);
+                    *msg.add_rpcs() = std::move(*rpcs);
+                }
+            }
+            if (msg.groups_size() == 0) {
+                continue;
+            }
+            auto sent = std::chrono::system_clock::now();
+            bus_.send<GroupHeartbeats, GroupResponses>(msg, id, kGroupHeartbeats, options_.heartbeat_timeout)
+                .subscribe([this, id, msg, sent](bus::ErrorT<GroupResponses>& result) {
+                        for (int i = 0; i < msg.groups_size(); ++i) {
+                            auto response = result && i < result.unwrap().responses_size()
+                                ? bus::ErrorT<Response>::value(result.unwrap().responses(i))
+                                : bus::ErrorT<Response>::error("group heartbeat failed");
+                            groups_[msg.groups(i)]->handle_heartbeat_response(id, msg.rpcs(i).term(), sent, response);
+                        }
+                    });
+        }
+    }
+
+    GroupResponses handle_heartbeats(int node, GroupHeartbeats msg) {
+        GroupResponses responses;
+        for (int i = 0; i < msg.groups_size() && i < msg.rpcs_size(); ++i) {
+            if (msg.groups(i) >= groups_.size()) {
+                // a peer configured with more groups than this node
+                spdlog::warn("heartbeat from {0:d} for unknown group {1:d}", node, msg.groups(i));
+                responses.add_responses()->set_success(false);
+                continue;
+            }
+            // record-less AppendRpcs are answered without waiting for fsync
+            *responses.add_responses() = groups_[msg.groups(i)]->handle_append_rpcs(node, std::move(*msg.mutable_rpcs(i))).wait();
+        }
+        return responses;
+    }
+
+private:
+    RaftTransport& bus_;
+    RaftNode::Options options_;
+    uint64_t id_;
+    SharedSync sync_;
+    std::vector<std::unique_ptr<RaftNode>> groups_;
+    bus::internal::PeriodicExecutor sender_;
+};
+
 duration parse_duration(const Json::Value& val) {
     assert(!val.isNull());
     return std::chrono::duration_cast<duration>(std::chrono::duration<double>(val.asFloat()));
@@ -1120,11 +2812,29 @@ int main(int argc, char** argv) {
     options.heartbeat_timeout = parse_duration(conf["heartbeat_timeout"]);
     options.heartbeat_interval = parse_duration(conf["heartbeat_interval"]);
     options.election_timeout = parse_duration(conf["election_timeout"]);
+    options.lease_timeout = parse_duration(conf["lease_timeout"]);
     options.applied_backlog = conf["applied_backlog"].asUInt64();
     options.rotate_interval = parse_duration(conf["rotate_interval"]);
+    options.changelog_segment_size = conf["changelog_segment_size"].asUInt64();
     options.flush_interval = parse_duration(conf["flush_interval"]);
+    options.flush_max_records = conf["flush_max_records"].asUInt64();
+    options.flush_max_bytes = conf["flush_max_bytes"].asUInt64();
     options.rpc_max_batch = conf["rpc_max_batch"].asUInt64();
+    options.max_inflight_batches = std::max<uint64_t>(conf["max_inflight_batches"].asUInt64(), 1);
     options.members = members.size();
+    options.follower_reads = conf["follower_reads"].asBool();
+    options.storage = conf.get("storage", "hash").asString();
+    options.recovery_threads = conf["recovery_threads"].asUInt64();
+    options.max_snapshot_deltas = conf["max_snapshot_deltas"].asUInt64();
+    options.snapshot_chunk_size = conf["snapshot_chunk_size"].asUInt64();
+    options.snapshot_window = conf["snapshot_window"].asUInt64();
+    options.recovery_bandwidth = conf["recovery_bandwidth"].asUInt64();
+    options.groups = std::max<uint64_t>(conf["groups"].asUInt64(), 1);
+    options.pin_cores = conf["pin_cores"].asBool();
+    options.coalesce_window = parse_duration(conf["coalesce_window"]);
+    options.coalesce_max_bytes = conf["coalesce_max_bytes"].asUInt64();
+    options.log_memory_limit = conf["log_memory_limit"].asUInt64();
+    options.catchup_window = std::max<uint64_t>(conf["catchup_window"].asUInt64(), 1);
 
     spdlog::set_pattern("[%H:%M:%S.%e] [" + std::to_string(id) + "] [%^%l%$] %v");
 
@@ -1134,6 +2844,16 @@ int main(int argc, char** argv) {
 
     spdlog::info("starting node");
 
-    RaftNode node(manager, options);
-    node.shot_down().wait();
+    RaftTransport bus(options.bus_options, manager);
+    if (options.groups > 1) {
+        RaftGroups groups(bus, options);
+        bus.start();
+        groups.start();
+        groups.shot_down().wait();
+    } else {
+        RaftNode node(bus, options);
+        bus.start();
+        node.start();
+        node.shot_down().wait();
+    }
 }
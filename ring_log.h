@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// sequence indexed from its front with O(1) push_back and trimming at both ends: items live in a
+// power of two ring that doubles when full, so dropping a prefix never moves the rest of the items
+template<typename T>
+class RingLog {
+public:
+    RingLog() {
+        ring_.resize(kMinCapacity);
+    }
+
+    void push_back(T item) {
+        if (size_ == ring_.size()) {
+            grow();
+        }
+        at(size_) = std::move(item);
+        ++size_;
+    }
+
+    // drops count items from the front, costs count and not size()
+    void pop_front(size_t count) {
+        assert(count <= size_);
+        for (size_t i = 0; i < count; ++i) {
+            ring_[head_] = T();
+            head_ = (head_ + 1) & (ring_.size() - 1);
+        }
+        size_ -= count;
+    }
+
+    // keeps the first size items
+    void truncate(size_t size) {
+        for (; size_ > size; --size_) {
+            at(size_ - 1) = T();
+        }
+    }
+
+    void clear() {
+        truncate(0);
+        head_ = 0;
+    }
+
+    T& operator[](size_t index) {
+        assert(index < size_);
+        return at(index);
+    }
+
+    const T& operator[](size_t index) const {
+        assert(index < size_);
+        return ring_[(head_ + index) & (ring_.size() - 1)];
+    }
+
+    T& front() {
+        return (*this)[0];
+    }
+
+    T& back() {
+        return (*this)[size_ - 1];
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    static constexpr size_t kMinCapacity = 64;
+
+    T& at(size_t index) {
+        return ring_[(head_ + index) & (ring_.size() - 1)];
+    }
+
+    void grow() {
+        std::vector<T> ring(ring_.size() * 2);
+        for (size_t i = 0; i < size_; ++i) {
+            ring[i] = std::move(at(i));
+        }
+        ring_.swap(ring);
+        head_ = 0;
+    }
+
+private:
+    std::vector<T> ring_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+};
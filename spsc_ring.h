@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// bounded lock-free ring for exactly one producer thread and one consumer thread
+template<typename T>
+class SpscRing {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    bool push(T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ > mask_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ > mask_) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_) {
+                return false;
+            }
+        }
+        item = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t mask_;
+    // consumer side
+    alignas(64) std::atomic<size_t> head_ = 0;
+    size_t cached_tail_ = 0;
+    // producer side
+    alignas(64) std::atomic<size_t> tail_ = 0;
+    size_t cached_head_ = 0;
+};
+
+// many producers, one consumer, built from a SpscRing per producer thread;
+// a producer registers its ring on first push, the consumer sleeps only when every ring is empty
+template<typename T>
+class IntakeQueue {
+private:
+    static constexpr size_t kRingCapacity = 1024;
+
+public:
+    void push(T item) {
+        auto& ring = producer_ring();
+        while (!ring.push(item)) {
+            wake();
+            std::this_thread::yield();
+        }
+        // pairs with the fence in pop(): either the consumer sees the item or we see it sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load(std::memory_order_relaxed)) {
+            wake();
+        }
+    }
+
+    // moves up to max items to out, waits up to timeout if there are none
+    template<typename Duration>
+    size_t pop(std::vector<T>& out, size_t max, Duration timeout) {
+        size_t popped = drain(out, max);
+        if (popped > 0) {
+            return popped;
+        }
+        std::unique_lock lock(mutex_);
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ((popped = drain_locked(out, max)) == 0) {
+            wakeup_.wait_for(lock, timeout);
+        }
+        sleeping_.store(false, std::memory_order_relaxed);
+        return popped ? popped : drain_locked(out, max);
+    }
+
+    void wake() {
+        std::lock_guard guard(mutex_);
+        wakeup_.notify_one();
+    }
+
+private:
+    SpscRing<T>& producer_ring() {
+        // keyed by id rather than address, entries of destroyed queues are never matched again
+        thread_local std::vector<std::pair<uint64_t, SpscRing<T>*>> rings;
+        for (auto& [id, ring] : rings) {
+            if (id == id_) {
+                return *ring;
+            }
+        }
+        std::lock_guard guard(mutex_);
+        rings_.push_back(std::make_unique<SpscRing<T>>(kRingCapacity));
+        rings.emplace_back(id_, rings_.back().get());
+        return *rings_.back();
+    }
+
+    size_t drain(std::vector<T>& out, size_t max) {
+        std::lock_guard guard(mutex_);
+        return drain_locked(out, max);
+    }
+
+    size_t drain_locked(std::vector<T>& out, size_t max) {
+        size_t popped = 0;
+        T item;
+        for (auto& ring : rings_) {
+            while (popped < max && ring->pop(item)) {
+                out.push_back(std::move(item));
+                ++popped;
+            }
+        }
+        return popped;
+    }
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> ids = 0;
+        return ids.fetch_add(1);
+    }
+
+private:
+    const uint64_t id_ = next_id();
+    // guards rings_ registration and the consumer's sleep, never held by a push that has room
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::atomic<bool> sleeping_ = false;
+    std::vector<std::unique_ptr<SpscRing<T>>> rings_;
+};
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// key-value engine behind StateMachine, synchronization is up to the caller
+// string_views returned by find() are valid until the next modification
+class Storage {
+public:
+    virtual ~Storage() = default;
+
+    virtual std::optional<std::string_view> find(std::string_view key) const = 0;
+    virtual void set(std::string_view key, std::string_view value) = 0;
+    virtual void reserve(size_t) {}
+    virtual void clear() = 0;
+    virtual size_t size() const = 0;
+    virtual void for_each(const std::function<void(std::string_view, std::string_view)>& f) const = 0;
+};
+
+class MapStorage : public Storage {
+public:
+    std::optional<std::string_view> find(std::string_view key) const override {
+        if (auto it = data_.find(key); it != data_.end()) {
+            return it->second;
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    void set(std::string_view key, std::string_view value) override {
+        if (auto it = data_.find(key); it != data_.end()) {
+            it->second.assign(value);
+        } else {
+            data_.emplace(key, value);
+        }
+    }
+
+    void clear() override {
+        data_.clear();
+    }
+
+    size_t size() const override {
+        return data_.size();
+    }
+
+    void for_each(const std::function<void(std::string_view, std::string_view)>& f) const override {
+        for (auto& [k, v] : data_) {
+            f(k, v);
+        }
+    }
+
+private:
+    std::map<std::string, std::string, std::less<>> data_;
+};
+
+// bump allocator, memory is released only by clear()
+class Arena {
+private:
+    static constexpr size_t kBlockSize = 1 << 20;
+
+public:
+    char* allocate(size_t sz) {
+        if (sz > left_) {
+            size_t block = std::max(sz, kBlockSize);
+            blocks_.emplace_back(new char[block]);
+            ptr_ = blocks_.back().get();
+            left_ = block;
+            allocated_ += block;
+        }
+        auto result = ptr_;
+        ptr_ += sz;
+        left_ -= sz;
+        return result;
+    }
+
+    size_t allocated() const {
+        return allocated_;
+    }
+
+    void clear() {
+        blocks_.clear();
+        ptr_ = nullptr;
+        left_ = allocated_ = 0;
+    }
+
+    void swap(Arena& other) {
+        blocks_.swap(other.blocks_);
+        std::swap(ptr_, other.ptr_);
+        std::swap(left_, other.left_);
+        std::swap(allocated_, other.allocated_);
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* ptr_ = nullptr;
+    size_t left_ = 0;
+    size_t allocated_ = 0;
+};
+
+// open addressing with linear probing; slots are packed (hash tag, entry index) pairs,
+// so a probe sequence stays within a couple of cache lines and touches entries_ only on tag match.
+// Keys and values live in the arena, entries_ is dense and never reordered.
+class HashStorage : public Storage {
+private:
+    struct Entry {
+        const char* key;
+        char* value;
+        uint32_t key_size;
+        uint32_t value_size;
+        uint32_t value_capacity;
+    };
+
+    static constexpr uint64_t kEmpty = 0;
+    static constexpr size_t kMinSlots = 16;
+
+public:
+    HashStorage() {
+        slots_.assign(kMinSlots, kEmpty);
+    }
+
+    std::optional<std::string_view> find(std::string_view key) const override {
+        if (auto index = lookup(key, hash(key))) {
+            auto& entry = entries_[*index];
+            return std::string_view(entry.value, entry.value_size);
+        } else {
+            return std::nullopt;
+        }
+    }
+
+    void set(std::string_view key, std::string_view value) override {
+        uint64_t h = hash(key);
+        if (auto index = lookup(key, h)) {
+            assign(entries_[*index], value);
+            maybe_compact();
+            return;
+        }
+        if ((entries_.size() + 1) * 4 > slots_.size() * 3) {
+            rehash(slots_.size() * 2);
+        }
+        Entry entry;
+        char* key_data = arena_.allocate(key.size());
+        if (!key.empty()) {
+            memcpy(key_data, key.data(), key.size());
+        }
+        entry.key = key_data;
+        entry.key_size = key.size();
+        live_bytes_ += key.size();
+        entry.value = nullptr;
+        entry.value_size = entry.value_capacity = 0;
+        assign(entry, value);
+        entries_.push_back(entry);
+        place(h, entries_.size() - 1);
+        maybe_compact();
+    }
+
+    void reserve(size_t sz) override {
+        entries_.reserve(sz);
+        size_t slots = slots_.size();
+        while (sz * 4 > slots * 3) {
+            slots *= 2;
+        }
+        if (slots != slots_.size()) {
+            rehash(slots);
+        }
+    }
+
+    void clear() override {
+        entries_.clear();
+        slots_.assign(kMinSlots, kEmpty);
+        arena_.clear();
+        live_bytes_ = 0;
+    }
+
+    size_t size() const override {
+        return entries_.size();
+    }
+
+    void for_each(const std::function<void(std::string_view, std::string_view)>& f) const override {
+        for (auto& entry : entries_) {
+            f(std::string_view(entry.key, entry.key_size), std::string_view(entry.value, entry.value_size));
+        }
+    }
+
+private:
+    static uint64_t hash(std::string_view key) {
+        return std::hash<std::string_view>()(key);
+    }
+
+    static uint64_t tag(uint64_t h) {
+        return h >> 32;
+    }
+
+    std::optional<size_t> lookup(std::string_view key, uint64_t h) const {
+        size_t mask = slots_.size() - 1;
+        for (size_t pos = h & mask; slots_[pos] != kEmpty; pos = (pos + 1) & mask) {
+            if ((slots_[pos] >> 32) != tag(h)) {
+                continue;
+            }
+            size_t index = (slots_[pos] & 0xffffffff) - 1;
+            auto& entry = entries_[index];
+            if (std::string_view(entry.key, entry.key_size) == key) {
+                return index;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void place(uint64_t h, size_t index) {
+        size_t mask = slots_.size() - 1;
+        size_t pos = h & mask;
+        while (slots_[pos] != kEmpty) {
+            pos = (pos + 1) & mask;
+        }
+        slots_[pos] = (tag(h) << 32) | (index + 1);
+    }
+
+    void rehash(size_t slots) {
+        slots_.assign(slots, kEmpty);
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            place(hash(std::string_view(entries_[i].key, entries_[i].key_size)), i);
+        }
+    }
+
+    void assign(Entry& entry, std::string_view value) {
+        if (value.size() > entry.value_capacity) {
+            entry.value = arena_.allocate(value.size());
+            entry.value_capacity = value.size();
+        }
+        live_bytes_ += value.size();
+        live_bytes_ -= entry.value_size;
+        if (!value.empty()) {
+            memcpy(entry.value, value.data(), value.size());
+        }
+        entry.value_size = value.size();
+    }
+
+    // overwritten values with grown size leave garbage behind
+    void maybe_compact() {
+        if (arena_.allocated() > 2 * live_bytes_ + (16 << 20)) {
+            compact();
+        }
+    }
+
+    void compact() {
+        Arena arena;
+        size_t live = 0;
+        for (auto& entry : entries_) {
+            char* data = arena.allocate(entry.key_size + entry.value_size);
+            // empty keys and values may have never been allocated
+            if (entry.key_size > 0) {
+                memcpy(data, entry.key, entry.key_size);
+            }
+            if (entry.value_size > 0) {
+                memcpy(data + entry.key_size, entry.value, entry.value_size);
+            }
+            entry.key = data;
+            entry.value = data + entry.key_size;
+            entry.value_capacity = entry.value_size;
+            live += entry.key_size + entry.value_size;
+        }
+        arena_.swap(arena);
+        live_bytes_ = live;
+    }
+
+private:
+    std::vector<uint64_t> slots_;
+    std::vector<Entry> entries_;
+    Arena arena_;
+    // key and value bytes referenced from entries_
+    size_t live_bytes_ = 0;
+};
+
+// "hash" or "map", anything else is a configuration error
+inline std::unique_ptr<Storage> make_storage(std::string_view engine) {
+    if (engine == "map") {
+        return std::make_unique<MapStorage>();
+    } else if (engine == "hash") {
+        return std::make_unique<HashStorage>();
+    } else {
+        throw std::invalid_argument("unknown storage engine " + std::string(engine));
+    }
+}